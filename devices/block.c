@@ -139,6 +139,59 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK, sector SECTOR + I into BUFFERS[I], each of which must
+   have room for BLOCK_SECTOR_SIZE bytes.  The transfer is a
+   single request if the driver supports it, which is much
+   faster than CNT calls to block_read().
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *const buffers[], size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_multiple != NULL)
+    {
+      block->ops->read_multiple (block->aux, sector, buffers, cnt);
+      block->read_cnt += cnt;
+    }
+  else
+    for (i = 0; i < cnt; i++)
+      block_read (block, sector + i, buffers[i]);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to
+   BLOCK, sector SECTOR + I from BUFFERS[I], each of which must
+   contain BLOCK_SECTOR_SIZE bytes.  Returns after the block
+   device has acknowledged receiving all of the data.  The
+   transfer is a single request if the driver supports it.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      void *const buffers[], size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multiple != NULL)
+    {
+      block->ops->write_multiple (block->aux, sector, buffers, cnt);
+      block->write_cnt += cnt;
+    }
+  else
+    for (i = 0; i < cnt; i++)
+      block_write (block, sector + i, buffers[i]);
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include <string.h>
 
+/* Number of directory entries read at once. */
+#define LS_BATCH 32
+
 static bool
 list_dir (const char *dir, bool verbose)
 {
@@ -24,39 +27,41 @@ list_dir (const char *dir, bool verbose)
 
   if (isdir (dir_fd))
     {
-      char name[READDIR_MAX_LEN];
+      struct readdir_record records[LS_BATCH];
+      int cnt, i;
 
       printf ("%s", dir);
       if (verbose)
         printf (" (inumber %d)", inumber (dir_fd));
       printf (":\n");
 
-      while (readdir (dir_fd, name))
-        {
-          printf ("%s", name);
-          if (verbose)
-            {
-              char full_name[128];
-              int entry_fd;
-
-              snprintf (full_name, sizeof full_name, "%s/%s", dir, name);
-              entry_fd = open (full_name);
+      while ((cnt = readdir_batch (dir_fd, records, LS_BATCH)) > 0)
+        for (i = 0; i < cnt; i++)
+          {
+            printf ("%s", records[i].name);
+            if (verbose)
+              {
+                printf (": ");
+                if (records[i].is_dir)
+                  printf ("directory");
+                else
+                  {
+                    char full_name[128];
+                    int entry_fd;
 
-              printf (": ");
-              if (entry_fd != -1)
-                {
-                  if (isdir (entry_fd))
-                    printf ("directory");
-                  else
-                    printf ("%d-byte file", filesize (entry_fd));
-                  printf (", inumber %d", inumber (entry_fd));
-                }
-              else
-                printf ("open failed");
-              close (entry_fd);
-            }
-          printf ("\n");
-        }
+                    snprintf (full_name, sizeof full_name, "%s/%s",
+                              dir, records[i].name);
+                    entry_fd = open (full_name);
+                    if (entry_fd != -1)
+                      printf ("%d-byte file", filesize (entry_fd));
+                    else
+                      printf ("open failed");
+                    close (entry_fd);
+                  }
+                printf (", inumber %u", records[i].inumber);
+              }
+            printf ("\n");
+          }
     }
   else
     printf ("%s: not a directory\n", dir);
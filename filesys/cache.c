@@ -1,179 +1,1216 @@
 #include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/condvar.h"
 #include "threads/lock.h"
+#include "threads/loader.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/semaphore.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
 
-#define BUFFER_CACHE_SIZE 64
+/* Number of sectors that fit into a single page of cache buffers. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Default cache size, as a fraction of the physical memory:
+   1/BUFFER_CACHE_RAM_FRACTION of RAM, but at least
+   BUFFER_CACHE_MIN_SIZE sectors. */
+#define BUFFER_CACHE_RAM_FRACTION 16
+#define BUFFER_CACHE_MIN_SIZE 64
+
+/* Maximum number of pending read-ahead requests. */
+#define READ_AHEAD_QUEUE_SIZE 64
+
+/* Write-behind defaults: dirty entries are written back every
+   WRITE_BEHIND_INTERVAL milliseconds, or as soon as more than
+   WRITE_BEHIND_DIRTY_RATIO percent of the cache is dirty. */
+#define WRITE_BEHIND_INTERVAL 1000
+#define WRITE_BEHIND_DIRTY_RATIO 25
+
+/* Number of entries written back by the write-behind thread in a row. */
+#define WRITE_BEHIND_BATCH 16
+
+/* Maximum number of consecutive sectors read or written back by a
+   single multi-sector disk request. */
+#define BUFFER_CACHE_MAX_RUN 32
+
+/* State of an occupied cache entry.
+   Disk I/O is done without holding buffer_cache_lock; the entry is
+   pinned meanwhile, and the state tells other threads about it. */
+enum buffer_cache_state {
+  BUFFER_CACHE_LOADING,   // being read from disk; the data is not valid yet
+  BUFFER_CACHE_VALID,     // the data is valid, no I/O in flight
+  BUFFER_CACHE_WRITING    // being written back; the data is valid
+};
 
 struct buffer_cache_entry_t {
   bool occupied;  // true only if this entry is valid cache entry
+                  // (otherwise, it is in ::buffer_cache_free_list)
 
   block_sector_t disk_sector;
-  uint8_t buffer[BLOCK_SECTOR_SIZE];
+  uint8_t *buffer;  // BLOCK_SECTOR_SIZE bytes, within a page of cache buffers
+  enum buffer_cache_state state;
 
   bool dirty;     // dirty bit
-  bool access;    // reference bit, for clock algorithm
+  bool access;    // reference bit, set on every access
+  int pin_cnt;    // number of buffer_cache_get() without matching put,
+                  // plus one during disk I/O on the entry;
+                  // the entry is never evicted while it is positive
+
+  struct hash_elem helem;   // see ::buffer_cache_map (only if occupied)
+  struct list_elem lelem;   // free list, or a queue of the replacement policy
+  bool hot;                 // 2Q: true if in the Am queue, false if in A1in
+  bool prefetched;          // brought in by read-ahead, and not accessed yet
+  bool loaded;              // brought in by buffer_cache_load(), and not
+                            // accessed yet (the access counts as the miss)
+  bool held;                // part of a journal transaction not committed
+                            // yet: not written back (see buffer_cache_get)
+  bool sync;                // to be written back by the next group commit
+                            // (see buffer_cache_sync_sectors)
+};
+
+/* A replacement policy, which decides the entry to be evicted.
+   All of the callbacks are called with buffer_cache_lock held. */
+struct buffer_cache_policy {
+  const char *name;
+  void (*init) (void);
+  void (*insert) (struct buffer_cache_entry_t *);  // an entry got occupied
+  void (*touch) (struct buffer_cache_entry_t *);   // a cache hit on the entry
+  void (*remove) (struct buffer_cache_entry_t *);  // the entry is evicted
+  // returns an occupied, unpinned entry to evict, or NULL if none.
+  struct buffer_cache_entry_t *(*victim) (void);
 };
 
-/* Buffer cache entries. */
-static struct buffer_cache_entry_t cache[BUFFER_CACHE_SIZE];
+static const struct buffer_cache_policy clock_policy;
+static const struct buffer_cache_policy twoq_policy;
+
+/* Available replacement policies. The first one is the default. */
+static const struct buffer_cache_policy *buffer_cache_policies[] =
+  { &twoq_policy, &clock_policy, NULL };
+
+/* Buffer cache entries, allocated at buffer_cache_init(). */
+static struct buffer_cache_entry_t *cache;
 
-/* A global lock for synchronizing buffer cache operations. */
+/* Number of entries in the buffer cache.
+   Set by -cache=SECTORS on the kernel command line, if non-zero. */
+static size_t buffer_cache_size;
+
+/* A mapping from disk sector to the occupied cache entry holding it. */
+static struct hash buffer_cache_map;
+
+/* Unoccupied cache entries. */
+static struct list buffer_cache_free_list;
+
+/* The replacement policy in use.
+   Set by -cache-policy=NAME on the kernel command line. */
+static const struct buffer_cache_policy *policy = &twoq_policy;
+
+/* A global lock for synchronizing buffer cache operations.
+   It protects the sector index and the metadata of the entries,
+   but is never held across disk I/O. */
 static struct lock buffer_cache_lock;
 
+/* Broadcast whenever disk I/O on a cache entry completes. */
+static struct condvar buffer_cache_io_done;
+
+/* Number of dirty entries. Protected by buffer_cache_lock. */
+static size_t buffer_cache_dirty_cnt;
+
+/* Statistics. Protected by buffer_cache_lock. */
+static struct buffer_cache_stats buffer_cache_stats;
+
+/* Write-behind parameters, set by -wb-interval=MS and -wb-ratio=PERCENT
+   on the kernel command line. */
+static unsigned write_behind_interval = WRITE_BEHIND_INTERVAL;
+static unsigned write_behind_ratio = WRITE_BEHIND_DIRTY_RATIO;
+
+/* Upped to wake the write-behind thread up: periodically by the
+   write-behind timer thread, and on reaching the dirty ratio. */
+static struct semaphore write_behind_sema;
+
+/* Group commit of the entries asked to be written back right away,
+   by buffer_cache_sync_sectors() and buffer_cache_sync_all(). The
+   callers that come while a batch is being written mark their
+   entries, and the first of them writes all of them, as the next
+   batch, in sector order. Protected by buffer_cache_lock. */
+static bool sync_running;             /* A batch is being written. */
+static unsigned sync_started;         /* Number of batches started. */
+static unsigned sync_done;            /* Number of batches completed. */
+static struct condvar sync_cond;      /* Broadcast when a batch completes. */
+static block_sector_t *sync_batch;    /* Sectors of the running batch. */
+
+static thread_func buffer_cache_write_behind_worker NO_RETURN;
+static thread_func buffer_cache_write_behind_timer NO_RETURN;
+
+/* Pending read-ahead requests (a circular queue of disk sectors),
+   served by the read-ahead thread. Protected by read_ahead_lock. */
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;      /* index of the oldest request */
+static size_t read_ahead_cnt;       /* number of pending requests */
+static struct lock read_ahead_lock;
+static struct condvar read_ahead_cond;  /* signaled when a request arrives */
+
+static thread_func buffer_cache_read_ahead_worker NO_RETURN;
+
+static struct buffer_cache_entry_t *buffer_cache_lookup (block_sector_t);
+static unsigned buffer_cache_hash_func (const struct hash_elem *, void *);
+static bool buffer_cache_less_func (const struct hash_elem *,
+                                    const struct hash_elem *, void *);
+
+void
+buffer_cache_configure (size_t sectors)
+{
+  buffer_cache_size = sectors;
+}
+
+bool
+buffer_cache_configure_policy (const char *name)
+{
+  const struct buffer_cache_policy **p;
+  for (p = buffer_cache_policies; *p != NULL; p++)
+    if (!strcmp (name, (*p)->name)) {
+      policy = *p;
+      return true;
+    }
+  return false;
+}
+
+void
+buffer_cache_configure_write_behind (unsigned interval, unsigned ratio)
+{
+  if (interval > 0)
+    write_behind_interval = interval;
+  if (ratio > 0)
+    write_behind_ratio = ratio;
+}
+
 void
 buffer_cache_init (void)
 {
   lock_init (&buffer_cache_lock);
+  condvar_init (&buffer_cache_io_done);
+  hash_init (&buffer_cache_map, buffer_cache_hash_func,
+             buffer_cache_less_func, NULL);
+  list_init (&buffer_cache_free_list);
+
+  // default size: a fraction of the physical memory
+  size_t requested = buffer_cache_size;
+  if (requested == 0) {
+    requested = (size_t) init_ram_pages * SECTORS_PER_PAGE
+      / BUFFER_CACHE_RAM_FRACTION;
+    if (requested < BUFFER_CACHE_MIN_SIZE)
+      requested = BUFFER_CACHE_MIN_SIZE;
+  }
+
+  cache = calloc (requested, sizeof *cache);
+  if (cache == NULL)
+    PANIC ("buffer cache allocation failed (%zu sectors)", requested);
 
-  // initialize entries
+  // initialize entries, taking buffers page by page from the kernel pool.
+  // the cache is shrunk if the pool runs out of pages.
   size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
+  uint8_t *page = NULL;
+  for (i = 0; i < requested; ++ i)
   {
+    if (i % SECTORS_PER_PAGE == 0) {
+      page = palloc_get_page (0);
+      if (page == NULL) break;
+    }
     cache[i].occupied = false;
+    cache[i].buffer = page + (i % SECTORS_PER_PAGE) * BLOCK_SECTOR_SIZE;
+    list_push_back (&buffer_cache_free_list, &cache[i].lelem);
   }
+  buffer_cache_size = i;
+  if (buffer_cache_size == 0)
+    PANIC ("buffer cache allocation failed (%zu sectors)", requested);
+
+  condvar_init (&sync_cond);
+  sync_running = false;
+  sync_started = sync_done = 0;
+  sync_batch = malloc (buffer_cache_size * sizeof *sync_batch);
+  if (sync_batch == NULL)
+    PANIC ("buffer cache allocation failed (%zu sectors)", requested);
+
+  policy->init ();
+  printf ("Buffer cache: %zu sectors (%zu kB), %s replacement.\n",
+          buffer_cache_size, buffer_cache_size * BLOCK_SECTOR_SIZE / 1024,
+          policy->name);
+
+  // start the read-ahead thread
+  lock_init (&read_ahead_lock);
+  condvar_init (&read_ahead_cond);
+  read_ahead_head = read_ahead_cnt = 0;
+  thread_create ("read-ahead", PRI_DEFAULT, buffer_cache_read_ahead_worker, NULL);
+
+  // start the write-behind threads
+  buffer_cache_dirty_cnt = 0;
+  semaphore_init (&write_behind_sema, 0);
+  thread_create ("write-behind", PRI_DEFAULT, buffer_cache_write_behind_worker, NULL);
+  thread_create ("write-behind-timer", PRI_DEFAULT, buffer_cache_write_behind_timer, NULL);
 }
 
 /**
- * An internal method for flushing back the cache entry into disk.
+ * Acquires buffer_cache_lock, accounting the time spent waiting for
+ * it in the statistics.
+ */
+static void
+buffer_cache_lock_acquire (void)
+{
+  if (lock_try_acquire (&buffer_cache_lock))
+    return;
+
+  int64_t start = timer_ticks ();
+  lock_acquire (&buffer_cache_lock);
+  buffer_cache_stats.lock_waits ++;
+  buffer_cache_stats.lock_wait_ticks += timer_elapsed (start);
+}
+
+/**
+ * Returns the cache entry holding `sector` if it is dirty and can be
+ * written back right now, or NULL otherwise.
  * Must be called with the lock held.
  */
+static struct buffer_cache_entry_t *
+buffer_cache_flushable (block_sector_t sector)
+{
+  struct buffer_cache_entry_t *entry = buffer_cache_lookup (sector);
+  if (entry == NULL || !entry->dirty || entry->state != BUFFER_CACHE_VALID
+      || entry->held)
+    return NULL;
+  return entry;
+}
+
+/**
+ * An internal method for flushing back the cache entry into disk.
+ * The dirty entries of the neighboring sectors are written back
+ * together, as a single multi-sector disk request.
+ * Must be called with the lock held, which is released during the
+ * disk write. Does nothing if the entry is being written already,
+ * or is held.
+ */
 static void
 buffer_cache_flush (struct buffer_cache_entry_t *entry)
 {
   ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
   ASSERT (entry != NULL && entry->occupied == true);
 
-  if (entry->dirty) {
-    block_write (fs_device, entry->disk_sector, entry->buffer);
-    entry->dirty = false;
+  if (!entry->dirty || entry->state != BUFFER_CACHE_VALID || entry->held)
+    return;
+
+  // the run of dirty sectors [first, first + n) around the entry
+  block_sector_t first = entry->disk_sector;
+  size_t n = 1;
+  while (n < BUFFER_CACHE_MAX_RUN && first > 0
+         && buffer_cache_flushable (first - 1) != NULL) {
+    first --;
+    n ++;
+  }
+  while (n < BUFFER_CACHE_MAX_RUN
+         && buffer_cache_flushable (first + n) != NULL)
+    n ++;
+
+  // the entries are clean from now on: each one is marked dirty again
+  // if someone writes into it while it is being written back.
+  void *buffers[BUFFER_CACHE_MAX_RUN];
+  size_t i;
+  for (i = 0; i < n; ++ i) {
+    struct buffer_cache_entry_t *e = buffer_cache_lookup (first + i);
+    e->dirty = false;
+    buffer_cache_dirty_cnt --;
+    e->state = BUFFER_CACHE_WRITING;
+    e->pin_cnt ++;
+    buffers[i] = e->buffer;
+  }
+  lock_release (&buffer_cache_lock);
+
+  block_write_multiple (fs_device, first, buffers, n);
+
+  buffer_cache_lock_acquire ();
+  buffer_cache_stats.write_backs += n;
+  if (n > 1)
+    buffer_cache_stats.multi_writes ++;
+  // pinned meanwhile: the entries still hold the same sectors
+  for (i = 0; i < n; ++ i) {
+    struct buffer_cache_entry_t *e = buffer_cache_lookup (first + i);
+    e->state = BUFFER_CACHE_VALID;
+    e->pin_cnt --;
   }
+  condvar_broadcast (&buffer_cache_io_done, &buffer_cache_lock);
+}
+
+/**
+ * Marks the cache entry dirty, and wakes the write-behind thread up
+ * if too many entries are dirty. Must be called with the lock held.
+ */
+static void
+buffer_cache_mark_dirty (struct buffer_cache_entry_t *entry)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (entry != NULL && entry->occupied == true);
+
+  if (entry->dirty) return;
+  entry->dirty = true;
+  buffer_cache_dirty_cnt ++;
+
+  if (buffer_cache_dirty_cnt * 100 >= buffer_cache_size * write_behind_ratio)
+    semaphore_up (&write_behind_sema);
 }
 
 void
 buffer_cache_close (void)
 {
-  // flush buffer cache entries
-  lock_acquire (&buffer_cache_lock);
+  buffer_cache_sync ();
+}
 
-  size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
-  {
-    if (cache[i].occupied == false) continue;
-    buffer_cache_flush( &(cache[i]) );
+void
+buffer_cache_sync (void)
+{
+  // flush buffer cache entries, until none is dirty nor being written.
+  // (the lock is released during each write: go over all of them again)
+  buffer_cache_lock_acquire ();
+
+  bool again = true;
+  while (again) {
+    again = false;
+    size_t i;
+    for (i = 0; i < buffer_cache_size; ++ i)
+    {
+      if (cache[i].occupied == false || cache[i].held) continue;
+      if (cache[i].state == BUFFER_CACHE_WRITING) {
+        condvar_wait (&buffer_cache_io_done, &buffer_cache_lock);
+        again = true;
+      }
+      else if (cache[i].dirty) {
+        buffer_cache_flush( &(cache[i]) );
+        again = true;
+      }
+    }
   }
 
   lock_release (&buffer_cache_lock);
 }
 
+/* Compares two sectors, for qsort(). */
+static int
+buffer_cache_sector_cmp (const void *a_, const void *b_)
+{
+  const block_sector_t *a = a_, *b = b_;
+  return *a < *b ? -1 : *a > *b;
+}
+
+/**
+ * Writes back a batch: the entries marked for the group commit, in
+ * sector order, waiting for those being written already.
+ * Must be called with the lock held, which is released during disk I/O.
+ */
+static void
+buffer_cache_sync_batch (void)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  // the batch is taken at once: the entries marked later on go into
+  // the next one.
+  size_t cnt = 0, i;
+  for (i = 0; i < buffer_cache_size; ++ i)
+    if (cache[i].occupied && cache[i].sync) {
+      cache[i].sync = false;
+      sync_batch[cnt ++] = cache[i].disk_sector;
+    }
+  qsort (sync_batch, cnt, sizeof *sync_batch, buffer_cache_sector_cmp);
+
+  for (i = 0; i < cnt; ++ i) {
+    // an entry evicted meanwhile has been written back
+    struct buffer_cache_entry_t *entry;
+    while ((entry = buffer_cache_lookup (sync_batch[i])) != NULL
+           && entry->state == BUFFER_CACHE_WRITING)
+      condvar_wait (&buffer_cache_io_done, &buffer_cache_lock);
+    // (the dirty neighbors are written along with it)
+    if (entry != NULL)
+      buffer_cache_flush (entry);
+  }
+}
+
+/**
+ * Marks the entry holding `sector`, if any, for the group commit, if
+ * it needs to be written back. Returns whether it does.
+ * Must be called with the lock held.
+ */
+static bool
+buffer_cache_sync_mark (block_sector_t sector)
+{
+  struct buffer_cache_entry_t *entry = buffer_cache_lookup (sector);
+  if (entry == NULL || entry->held
+      || (!entry->dirty && entry->state != BUFFER_CACHE_WRITING))
+    return false;
+  entry->sync = true;
+  return true;
+}
+
+/**
+ * Waits for the batch of the group commit that includes the entries
+ * marked so far, writing it if no one else is. Must be called with
+ * the lock held, which is released meanwhile.
+ */
+static void
+buffer_cache_sync_wait (void)
+{
+  // the running batch, if any, was taken before: wait for the next.
+  unsigned batch = sync_started + 1;
+
+  while ((int) (sync_done - batch) < 0) {
+    if (sync_running) {
+      condvar_wait (&sync_cond, &buffer_cache_lock);
+      continue;
+    }
+    sync_running = true;
+    sync_started ++;
+    buffer_cache_sync_batch ();
+    sync_done = sync_started;
+    sync_running = false;
+    condvar_broadcast (&sync_cond, &buffer_cache_lock);
+  }
+}
+
+void
+buffer_cache_sync_sectors (const block_sector_t *sectors, size_t cnt)
+{
+  buffer_cache_lock_acquire ();
+
+  bool marked = false;
+  size_t i;
+  for (i = 0; i < cnt; ++ i)
+    if (buffer_cache_sync_mark (sectors[i]))
+      marked = true;
+  if (marked)
+    buffer_cache_sync_wait ();
+
+  lock_release (&buffer_cache_lock);
+}
+
+void
+buffer_cache_sync_all (void)
+{
+  buffer_cache_lock_acquire ();
+
+  bool marked = false;
+  size_t i;
+  for (i = 0; i < buffer_cache_size; ++ i)
+    if (cache[i].occupied && buffer_cache_sync_mark (cache[i].disk_sector))
+      marked = true;
+  if (marked)
+    buffer_cache_sync_wait ();
+
+  lock_release (&buffer_cache_lock);
+}
+
+size_t
+buffer_cache_sectors (void)
+{
+  return buffer_cache_size;
+}
+
+void
+buffer_cache_release (block_sector_t sector)
+{
+  buffer_cache_lock_acquire ();
+
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
+  ASSERT (slot != NULL && slot->held);
+  slot->held = false;
+  slot->pin_cnt --;
+  // it is dirty: written back like any other entry from now on
+  if (slot->dirty
+      && buffer_cache_dirty_cnt * 100 >= buffer_cache_size * write_behind_ratio)
+    semaphore_up (&write_behind_sema);
+
+  lock_release (&buffer_cache_lock);
+}
+
 
 /**
  * Lookup the cache entry, and returns the pointer of buffer_cache_entry_t,
- * or NULL in case of cache miss. (simply traverse the cache entries)
+ * or NULL in case of cache miss. (hash lookup on the disk sector)
+ * Must be called with the lock held.
  */
 static struct buffer_cache_entry_t*
 buffer_cache_lookup (block_sector_t sector)
 {
-  size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
-  {
-    if (cache[i].occupied == false) continue;
-    if (cache[i].disk_sector == sector) {
-      // cache hit.
-      return &(cache[i]);
-    }
-  }
-  return NULL; // cache miss
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  // hash lookup : a temporary entry
+  struct buffer_cache_entry_t key;
+  key.disk_sector = sector;
+
+  struct hash_elem *h = hash_find (&buffer_cache_map, &key.helem);
+  if (h == NULL)
+    return NULL; // cache miss
+
+  // cache hit.
+  return hash_entry (h, struct buffer_cache_entry_t, helem);
+}
+
+/**
+ * Fill in an unoccupied cache entry for `sector`, and register it
+ * into the sector index. Must be called with the lock held.
+ */
+static void
+buffer_cache_install (struct buffer_cache_entry_t *slot, block_sector_t sector)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (slot != NULL && slot->occupied == false);
+
+  slot->occupied = true;
+  slot->disk_sector = sector;
+  slot->state = BUFFER_CACHE_VALID;
+  slot->dirty = false;
+  slot->pin_cnt = 0;
+  slot->prefetched = false;
+  slot->loaded = false;
+  slot->held = false;
+  slot->sync = false;
+  hash_insert (&buffer_cache_map, &slot->helem);
+  policy->insert (slot);
 }
 
 /**
  * Obtain a free cache entry slot.
  * If there is an unoccupied slot already, return it.
- * Otherwise, some entry should be evicted by the clock algorithm.
+ * Otherwise, some entry should be evicted, as chosen by the
+ * replacement policy. Pinned entries (see buffer_cache_get) are never
+ * evicted. A dirty victim is written back first, releasing the lock
+ * meanwhile. If every entry is pinned, waits for some disk I/O to
+ * complete, or returns NULL if `wait` is false (the caller holds pins
+ * of entries under I/O itself). Must be called with the lock held.
  */
 static struct buffer_cache_entry_t*
-buffer_cache_evict (void)
+buffer_cache_evict (bool wait)
 {
   ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
 
-  // clock algorithm
-  static size_t clock = 0;
   while (true) {
-    if (cache[clock].occupied == false) {
+    if (!list_empty (&buffer_cache_free_list)) {
       // found an empty slot -- use it
-      return &(cache[clock]);
+      struct list_elem *e = list_pop_front (&buffer_cache_free_list);
+      return list_entry (e, struct buffer_cache_entry_t, lelem);
     }
 
-    if (cache[clock].access) {
-      // give a second chance
-      cache[clock].access = false;
+    struct buffer_cache_entry_t *slot = policy->victim ();
+    if (slot == NULL) {
+      if (!wait) return NULL;
+      // every entry is pinned. wait, if some will be released by the I/O
+      size_t i;
+      for (i = 0; i < buffer_cache_size; ++ i)
+        if (cache[i].occupied && cache[i].state != BUFFER_CACHE_VALID) break;
+      if (i == buffer_cache_size)
+        PANIC ("Can't evict any buffer cache entry -- all of them are pinned");
+      condvar_wait (&buffer_cache_io_done, &buffer_cache_lock);
+      continue;
     }
-    else break;
+    ASSERT (slot->occupied && slot->pin_cnt == 0);
 
-    clock ++;
-    clock %= BUFFER_CACHE_SIZE;
-  }
+    bool clean = !slot->dirty;
+    if (slot->dirty) {
+      // write back into disk. it stays occupied (pinned during the
+      // write), but may have been used again meanwhile.
+      slot->access = false;
+      buffer_cache_flush (slot);
+      if (slot->pin_cnt > 0 || slot->dirty || slot->access) continue;
+    }
 
-  // evict cache[clock]
-  struct buffer_cache_entry_t *slot = &cache[clock];
-  if (slot->dirty) {
-    // write back into disk
-    buffer_cache_flush (slot);
+    // evict this slot
+    buffer_cache_stats.evictions ++;
+    if (clean)
+      buffer_cache_stats.clean_evictions ++;
+    policy->remove (slot);
+    hash_delete (&buffer_cache_map, &slot->helem);
+    slot->occupied = false;
+    return slot;
   }
-
-  slot->occupied = false;
-  return slot;
 }
 
+/* Puts back an unoccupied slot obtained by buffer_cache_evict(),
+   but not used after all. Must be called with the lock held. */
+static void
+buffer_cache_release_slot (struct buffer_cache_entry_t *slot)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (slot != NULL && slot->occupied == false);
 
-void
-buffer_cache_read (block_sector_t sector, void *target)
+  list_push_front (&buffer_cache_free_list, &slot->lelem);
+}
+
+/**
+ * Returns the cache entry holding `sector`, pinned. On a cache miss,
+ * the sector is read from disk if `read` is true; otherwise the caller
+ * is going to overwrite the whole sector, and the entry is just
+ * zero-filled. Concurrent misses on the same sector wait for a single
+ * read. `read_ahead` tells that the access is made by the read-ahead
+ * thread, rather than by a reader (only for the statistics).
+ * Must be called with the lock held, which is released during disk I/O.
+ */
+static struct buffer_cache_entry_t*
+buffer_cache_fetch (block_sector_t sector, bool read, bool read_ahead)
 {
-  lock_acquire (&buffer_cache_lock);
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
 
-  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
-  if (slot == NULL) {
+  struct buffer_cache_entry_t *slot;
+  while ((slot = buffer_cache_lookup (sector)) == NULL) {
     // cache miss: need eviction.
-    slot = buffer_cache_evict ();
+    slot = buffer_cache_evict (true);
     ASSERT (slot != NULL && slot->occupied == false);
 
+    // eviction may have released the lock: someone else may have
+    // brought the sector in meanwhile. (then, the slot is left free)
+    if (buffer_cache_lookup (sector) != NULL) {
+      buffer_cache_release_slot (slot);
+      continue;
+    }
+
     // fill in the cache entry.
-    slot->occupied = true;
-    slot->disk_sector = sector;
-    slot->dirty = false;
-    block_read (fs_device, sector, slot->buffer);
+    buffer_cache_install (slot, sector);
+    slot->access = true;
+    slot->pin_cnt = 1;
+    slot->prefetched = read_ahead;
+    if (read_ahead)
+      buffer_cache_stats.read_aheads ++;
+    else
+      buffer_cache_stats.misses ++;
+    if (read) {
+      slot->state = BUFFER_CACHE_LOADING;
+      lock_release (&buffer_cache_lock);
+
+      block_read (fs_device, sector, slot->buffer);
+
+      buffer_cache_lock_acquire ();
+      slot->state = BUFFER_CACHE_VALID;
+      condvar_broadcast (&buffer_cache_io_done, &buffer_cache_lock);
+    }
+    else
+      memset (slot->buffer, 0, BLOCK_SECTOR_SIZE);
+    return slot;
   }
 
-  // copy the buffer data into memory.
+  // cache hit: wait for the data if it is still being read.
+  slot->pin_cnt ++;
+  if (slot->loaded && !read_ahead) {
+    // the first access after buffer_cache_load(), made on behalf of it
+    buffer_cache_stats.misses ++;
+    slot->loaded = false;
+  }
+  else if (!read_ahead) {
+    buffer_cache_stats.hits ++;
+    if (slot->prefetched) {
+      buffer_cache_stats.read_ahead_hits ++;
+      slot->prefetched = false;
+    }
+  }
+  while (slot->state == BUFFER_CACHE_LOADING)
+    condvar_wait (&buffer_cache_io_done, &buffer_cache_lock);
+
   slot->access = true;
-  memcpy (target, slot->buffer, BLOCK_SECTOR_SIZE);
+  policy->touch (slot);
+  return slot;
+}
 
-  lock_release (&buffer_cache_lock);
+/**
+ * Brings the `cnt` disk sectors starting at `sector` into the cache,
+ * reading each run of consecutive sectors not cached yet with a single
+ * multi-sector disk request. Cached sectors are left alone: this is
+ * not an access. `read_ahead` is as in buffer_cache_fetch().
+ * Must be called with the lock held, which is released during disk I/O.
+ */
+static void
+buffer_cache_load_run (block_sector_t sector, size_t cnt, bool read_ahead)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  // a single request never pins more than a quarter of the cache
+  size_t max_run = buffer_cache_size / 4;
+  if (max_run > BUFFER_CACHE_MAX_RUN) max_run = BUFFER_CACHE_MAX_RUN;
+  if (max_run == 0) max_run = 1;
+
+  void *buffers[BUFFER_CACHE_MAX_RUN];
+  size_t i = 0;
+  while (i < cnt) {
+    if (buffer_cache_lookup (sector + i) != NULL) {
+      ++ i;
+      continue;
+    }
+
+    // install pinned, loading entries for the run of misses [i, i + n).
+    // the run ends early rather than waiting for an entry to evict,
+    // since the entries of the run are pinned by this thread.
+    size_t n = 0;
+    while (i + n < cnt && n < max_run
+           && buffer_cache_lookup (sector + i + n) == NULL) {
+      struct buffer_cache_entry_t *slot = buffer_cache_evict (n == 0);
+      if (slot == NULL) break;
+      // eviction may have released the lock
+      if (buffer_cache_lookup (sector + i + n) != NULL) {
+        buffer_cache_release_slot (slot);
+        break;
+      }
+      buffer_cache_install (slot, sector + i + n);
+      slot->access = true;
+      slot->pin_cnt = 1;
+      slot->state = BUFFER_CACHE_LOADING;
+      slot->prefetched = read_ahead;
+      slot->loaded = !read_ahead;
+      if (read_ahead)
+        buffer_cache_stats.read_aheads ++;
+      buffers[n ++] = slot->buffer;
+    }
+    if (n == 0) continue;   // brought in by someone else meanwhile
+
+    lock_release (&buffer_cache_lock);
+    block_read_multiple (fs_device, sector + i, buffers, n);
+    buffer_cache_lock_acquire ();
+
+    if (n > 1)
+      buffer_cache_stats.multi_reads ++;
+    size_t k;
+    for (k = 0; k < n; ++ k) {
+      struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector + i + k);
+      slot->state = BUFFER_CACHE_VALID;
+      slot->pin_cnt --;
+    }
+    condvar_broadcast (&buffer_cache_io_done, &buffer_cache_lock);
+    i += n;
+  }
+}
+
+/**
+ * Releases a pin of the cache entry, obtained by buffer_cache_fetch().
+ * Must be called with the lock held.
+ */
+static void
+buffer_cache_unpin (struct buffer_cache_entry_t *slot, bool dirty)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (slot != NULL && slot->occupied == true && slot->pin_cnt > 0);
+
+  if (dirty)
+    buffer_cache_mark_dirty (slot);
+  slot->pin_cnt --;
+}
+
+
+void
+buffer_cache_read (block_sector_t sector, void *target)
+{
+  // copy the buffer data into memory.
+  const void *buffer = buffer_cache_get (sector, BUFFER_CACHE_READ);
+  memcpy (target, buffer, BLOCK_SECTOR_SIZE);
+  buffer_cache_put (sector, BUFFER_CACHE_READ);
 }
 
 void
 buffer_cache_write (block_sector_t sector, const void *source)
 {
-  lock_acquire (&buffer_cache_lock);
+  // the whole sector is replaced: no need to read it on a miss.
+  void *buffer = buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE);
+  memcpy (buffer, source, BLOCK_SECTOR_SIZE);
+  buffer_cache_put (sector, BUFFER_CACHE_OVERWRITE);
+}
+
+void *
+buffer_cache_get (block_sector_t sector, enum buffer_cache_mode mode)
+{
+  buffer_cache_lock_acquire ();
+
+  bool meta = (mode == BUFFER_CACHE_META_WRITE
+               || mode == BUFFER_CACHE_META_OVERWRITE);
+  bool read = (mode != BUFFER_CACHE_OVERWRITE
+               && mode != BUFFER_CACHE_META_OVERWRITE);
+  struct buffer_cache_entry_t *slot = buffer_cache_fetch (sector, read, false);
+
+  if (meta) {
+    // a write-back in progress would take part of the changes in place.
+    while (slot->state == BUFFER_CACHE_WRITING)
+      condvar_wait (&buffer_cache_io_done, &buffer_cache_lock);
+    if (!slot->held) {
+      slot->held = true;
+      slot->pin_cnt ++;   // never evicted, until released
+    }
+  }
+
+  lock_release (&buffer_cache_lock);
+  return slot->buffer;
+}
+
+void
+buffer_cache_put (block_sector_t sector, enum buffer_cache_mode mode)
+{
+  buffer_cache_lock_acquire ();
 
   struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
-  if (slot == NULL) {
-    // cache miss: need eviction.
-    slot = buffer_cache_evict ();
-    ASSERT (slot != NULL && slot->occupied == false);
+  ASSERT (slot != NULL);
+  buffer_cache_unpin (slot, mode != BUFFER_CACHE_READ);
 
-    // fill in the cache entry.
-    slot->occupied = true;
-    slot->disk_sector = sector;
-    slot->dirty = false;
-    block_read (fs_device, sector, slot->buffer);
+  lock_release (&buffer_cache_lock);
+}
+
+void
+buffer_cache_load (block_sector_t sector, size_t cnt)
+{
+  buffer_cache_lock_acquire ();
+  buffer_cache_load_run (sector, cnt, false);
+  lock_release (&buffer_cache_lock);
+}
+
+void
+buffer_cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&read_ahead_lock);
+
+  // the request is simply dropped if the queue is full
+  if (read_ahead_cnt < READ_AHEAD_QUEUE_SIZE) {
+    read_ahead_queue[(read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE] = sector;
+    read_ahead_cnt ++;
+    condvar_signal (&read_ahead_cond, &read_ahead_lock);
   }
 
-  // copy the data form memory into the buffer cache.
-  slot->access = true;
-  slot->dirty = true;
-  memcpy (slot->buffer, source, BLOCK_SECTOR_SIZE);
+  lock_release (&read_ahead_lock);
+}
+
+/**
+ * The read-ahead thread: brings the requested sectors into the
+ * cache in background, so that a sequential reader finds them
+ * already cached.
+ */
+static void
+buffer_cache_read_ahead_worker (void *aux UNUSED)
+{
+  while (true) {
+    lock_acquire (&read_ahead_lock);
+    while (read_ahead_cnt == 0)
+      condvar_wait (&read_ahead_cond, &read_ahead_lock);
+
+    // take the request, along with the ones for the sectors following
+    // it, to be read with a single disk request
+    block_sector_t sector = read_ahead_queue[read_ahead_head];
+    size_t cnt = 0;
+    do {
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+      read_ahead_cnt --;
+      cnt ++;
+    } while (read_ahead_cnt > 0 && cnt < BUFFER_CACHE_MAX_RUN
+             && read_ahead_queue[read_ahead_head] == sector + cnt);
+    lock_release (&read_ahead_lock);
+
+    buffer_cache_lock_acquire ();
+    buffer_cache_load_run (sector, cnt, true);
+    lock_release (&buffer_cache_lock);
+  }
+}
+
+
+/**
+ * Writes all dirty entries back into disk, WRITE_BEHIND_BATCH entries
+ * at a time, yielding to other threads in between.
+ */
+static void
+buffer_cache_write_behind (void)
+{
+  size_t i = 0;
+  while (i < buffer_cache_size) {
+    buffer_cache_lock_acquire ();
+
+    size_t n = 0;
+    for (; i < buffer_cache_size && n < WRITE_BEHIND_BATCH; ++ i)
+    {
+      if (cache[i].occupied == false || cache[i].dirty == false) continue;
+      buffer_cache_flush( &(cache[i]) );
+      n ++;
+    }
+
+    lock_release (&buffer_cache_lock);
+    thread_yield ();
+  }
+}
+
+/**
+ * The write-behind thread: writes dirty entries back in background,
+ * so that a cache miss usually finds a clean entry to evict, and
+ * that data reach the disk without waiting for buffer_cache_close().
+ */
+static void
+buffer_cache_write_behind_worker (void *aux UNUSED)
+{
+  while (true) {
+    semaphore_down (&write_behind_sema);
+    // coalesce wake-ups that arrived in the meantime
+    while (semaphore_try_down (&write_behind_sema))
+      continue;
+
+    // the free map goes along with the inodes and the directories it
+    // accounts for, rather than only at shutdown.
+    free_map_flush ();
+    buffer_cache_write_behind ();
+  }
+}
 
+/* Wakes the write-behind thread up every write_behind_interval ms. */
+static void
+buffer_cache_write_behind_timer (void *aux UNUSED)
+{
+  while (true) {
+    timer_msleep (write_behind_interval);
+    semaphore_up (&write_behind_sema);
+  }
+}
+
+void
+buffer_cache_get_stats (struct buffer_cache_stats *stats)
+{
+  lock_acquire (&buffer_cache_lock);
+  *stats = buffer_cache_stats;
   lock_release (&buffer_cache_lock);
 }
+
+void
+buffer_cache_print_stats (void)
+{
+  // no locking: this is called at shutdown, possibly on a kernel panic.
+  if (cache == NULL) return;
+
+  const struct buffer_cache_stats *s = &buffer_cache_stats;
+  unsigned long long accesses = s->hits + s->misses;
+  printf ("Buffer cache: %llu hits, %llu misses (%llu%% hit rate), "
+          "%llu evictions (%llu clean), %llu write-backs\n",
+          s->hits, s->misses, accesses ? s->hits * 100 / accesses : 0,
+          s->evictions, s->clean_evictions, s->write_backs);
+  printf ("Buffer cache: %llu read-aheads (%llu hit), "
+          "%llu multi-sector reads, %llu multi-sector writes\n",
+          s->read_aheads, s->read_ahead_hits,
+          s->multi_reads, s->multi_writes);
+  printf ("Buffer cache: %llu lock waits (%"PRId64" ticks)\n",
+          s->lock_waits, s->lock_wait_ticks);
+}
+
+
+/* Replacement Policy : The Clock Algorithm */
+
+static size_t clock_hand;
+
+static void
+clock_init (void)
+{
+  clock_hand = 0;
+}
+
+static void
+clock_noop (struct buffer_cache_entry_t *slot UNUSED)
+{
+}
+
+static struct buffer_cache_entry_t *
+clock_victim (void)
+{
+  size_t it;
+  for (it = 0; it <= 2 * buffer_cache_size; ++ it) // 2n iterations is enough
+  {
+    struct buffer_cache_entry_t *slot = &cache[clock_hand];
+    clock_hand ++;
+    clock_hand %= buffer_cache_size;
+
+    if (slot->occupied == false || slot->pin_cnt > 0) continue;
+
+    if (slot->access) {
+      // give a second chance
+      slot->access = false;
+      continue;
+    }
+    return slot;
+  }
+  return NULL;
+}
+
+static const struct buffer_cache_policy clock_policy =
+  { "clock", clock_init, clock_noop, clock_noop, clock_noop, clock_victim };
+
+
+/* Replacement Policy : 2Q (Johnson and Shasha, VLDB '94)
+
+   A sector is first cached in the A1in FIFO queue. When it falls off
+   A1in, its number is remembered in the A1out ghost queue. Only if it
+   is missed again while still in A1out, it is cached in the Am LRU
+   queue. Thus a one-time sequential scan goes through A1in only, and
+   can't flush frequently used sectors (inodes, indirect blocks,
+   directories, ...) out of Am. */
+
+/* A1in is kept at 1/TWOQ_IN_FRACTION of the cache. A1out remembers
+   TWOQ_OUT_MULTIPLE times as many sectors as the cache holds, so that
+   a sector is still remembered after a long scan (a ghost is only a
+   few bytes, compared to the BLOCK_SECTOR_SIZE of a cache entry). */
+#define TWOQ_IN_FRACTION 4
+#define TWOQ_OUT_MULTIPLE 4
+
+/* A sector remembered in the A1out ghost queue. */
+struct twoq_ghost {
+  block_sector_t sector;
+  bool used;
+  struct hash_elem helem;
+};
+
+static struct list twoq_a1in;         /* front: most recently inserted */
+static struct list twoq_am;           /* front: most recently used */
+static size_t twoq_a1in_cnt;          /* number of entries in A1in */
+static size_t twoq_a1in_max;          /* threshold of A1in size */
+
+static struct twoq_ghost *twoq_a1out; /* circular FIFO of ghosts */
+static size_t twoq_a1out_size;
+static size_t twoq_a1out_next;        /* the slot to be reused next */
+static struct hash twoq_a1out_map;    /* sector -> used ghost */
+
+static unsigned twoq_ghost_hash_func (const struct hash_elem *, void *);
+static bool twoq_ghost_less_func (const struct hash_elem *,
+                                  const struct hash_elem *, void *);
+
+static void
+twoq_init (void)
+{
+  list_init (&twoq_a1in);
+  list_init (&twoq_am);
+  twoq_a1in_cnt = 0;
+  twoq_a1in_max = buffer_cache_size / TWOQ_IN_FRACTION;
+  if (twoq_a1in_max == 0) twoq_a1in_max = 1;
+
+  twoq_a1out_size = buffer_cache_size * TWOQ_OUT_MULTIPLE;
+  twoq_a1out_next = 0;
+  twoq_a1out = calloc (twoq_a1out_size, sizeof *twoq_a1out);
+  if (twoq_a1out == NULL)
+    PANIC ("buffer cache allocation failed (2Q ghost queue)");
+  hash_init (&twoq_a1out_map, twoq_ghost_hash_func, twoq_ghost_less_func, NULL);
+}
+
+/* Removes the ghost of SECTOR from A1out, if any.
+   Returns whether it was there. */
+static bool
+twoq_forget (block_sector_t sector)
+{
+  struct twoq_ghost key;
+  key.sector = sector;
+
+  struct hash_elem *h = hash_delete (&twoq_a1out_map, &key.helem);
+  if (h == NULL) return false;
+  hash_entry (h, struct twoq_ghost, helem)->used = false;
+  return true;
+}
+
+static void
+twoq_insert (struct buffer_cache_entry_t *slot)
+{
+  if (twoq_forget (slot->disk_sector)) {
+    // missed again shortly after leaving A1in: it is hot
+    slot->hot = true;
+    list_push_front (&twoq_am, &slot->lelem);
+  }
+  else {
+    slot->hot = false;
+    list_push_front (&twoq_a1in, &slot->lelem);
+    twoq_a1in_cnt ++;
+  }
+}
+
+static void
+twoq_touch (struct buffer_cache_entry_t *slot)
+{
+  // hits in A1in are correlated references: they don't count.
+  if (slot->hot) {
+    list_remove (&slot->lelem);
+    list_push_front (&twoq_am, &slot->lelem);
+  }
+}
+
+static void
+twoq_remove (struct buffer_cache_entry_t *slot)
+{
+  list_remove (&slot->lelem);
+  if (slot->hot) return;
+
+  // remember it in A1out, forgetting the oldest ghost if full
+  twoq_a1in_cnt --;
+  struct twoq_ghost *ghost = &twoq_a1out[twoq_a1out_next];
+  twoq_a1out_next = (twoq_a1out_next + 1) % twoq_a1out_size;
+  if (ghost->used)
+    hash_delete (&twoq_a1out_map, &ghost->helem);
+  ghost->sector = slot->disk_sector;
+  ghost->used = true;
+  hash_insert (&twoq_a1out_map, &ghost->helem);
+}
+
+/* Returns the least recently inserted/used unpinned entry of QUEUE. */
+static struct buffer_cache_entry_t *
+twoq_oldest_unpinned (struct list *queue)
+{
+  struct list_elem *e;
+  for (e = list_rbegin (queue); e != list_rend (queue); e = list_prev (e))
+  {
+    struct buffer_cache_entry_t *slot = list_entry (e, struct buffer_cache_entry_t, lelem);
+    if (slot->pin_cnt == 0) return slot;
+  }
+  return NULL;
+}
+
+static struct buffer_cache_entry_t *
+twoq_victim (void)
+{
+  struct buffer_cache_entry_t *slot = NULL;
+  if (twoq_a1in_cnt > twoq_a1in_max)
+    slot = twoq_oldest_unpinned (&twoq_a1in);
+  if (slot == NULL)
+    slot = twoq_oldest_unpinned (&twoq_am);
+  if (slot == NULL)
+    slot = twoq_oldest_unpinned (&twoq_a1in);
+  return slot;
+}
+
+static const struct buffer_cache_policy twoq_policy =
+  { "2q", twoq_init, twoq_insert, twoq_touch, twoq_remove, twoq_victim };
+
+
+/* Helpers */
+
+// Hash Functions required for [buffer_cache_map]. Uses 'disk_sector' as key.
+static unsigned
+buffer_cache_hash_func (const struct hash_elem *elem, void *aux UNUSED)
+{
+  struct buffer_cache_entry_t *entry = hash_entry (elem, struct buffer_cache_entry_t, helem);
+  return hash_int ((int) entry->disk_sector);
+}
+
+static bool
+buffer_cache_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED)
+{
+  struct buffer_cache_entry_t *a_entry = hash_entry (a, struct buffer_cache_entry_t, helem);
+  struct buffer_cache_entry_t *b_entry = hash_entry (b, struct buffer_cache_entry_t, helem);
+  return a_entry->disk_sector < b_entry->disk_sector;
+}
+
+// Hash Functions required for [twoq_a1out_map]. Uses 'sector' as key.
+static unsigned
+twoq_ghost_hash_func (const struct hash_elem *elem, void *aux UNUSED)
+{
+  struct twoq_ghost *ghost = hash_entry (elem, struct twoq_ghost, helem);
+  return hash_int ((int) ghost->sector);
+}
+
+static bool
+twoq_ghost_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                      void *aux UNUSED)
+{
+  struct twoq_ghost *a_ghost = hash_entry (a, struct twoq_ghost, helem);
+  struct twoq_ghost *b_ghost = hash_entry (b, struct twoq_ghost, helem);
+  return a_ghost->sector < b_ghost->sector;
+}
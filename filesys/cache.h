@@ -1,13 +1,62 @@
 #ifndef FILESYS_CACHE_H
 #define FILESYS_CACHE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "devices/block.h"
 
 /* Buffer Caches. */
 
+/**
+ * Sets the number of sectors held by the buffer cache, which
+ * takes effect at buffer_cache_init(). Zero picks a default
+ * proportional to the physical memory size.
+ */
+void buffer_cache_configure (size_t sectors);
+
+/**
+ * Selects the replacement policy of the buffer cache by its name,
+ * "2q" (the default) or "clock". Returns false if there is no such
+ * policy.
+ */
+bool buffer_cache_configure_policy (const char *name);
+
+/**
+ * Sets how often (in milliseconds) dirty entries are written back
+ * in background, and the percentage of dirty entries that triggers
+ * an early write-back. Zero keeps the default.
+ */
+void buffer_cache_configure_write_behind (unsigned interval, unsigned ratio);
+
 void buffer_cache_init (void);
 void buffer_cache_close (void);
 
+/**
+ * Writes every dirty entry back into disk, except the held ones,
+ * and returns once they have been written.
+ */
+void buffer_cache_sync (void);
+
+/**
+ * Writes back the dirty entries among the `cnt` disk sectors in
+ * `sectors`, or all of the dirty entries, and waits for them to reach
+ * the disk. Held entries are left alone. Concurrent callers are
+ * served together, by a single batch of writes in sector order.
+ */
+void buffer_cache_sync_sectors (const block_sector_t *sectors, size_t cnt);
+void buffer_cache_sync_all (void);
+
+/* Returns the number of sectors held by the buffer cache. */
+size_t buffer_cache_sectors (void);
+
+/**
+ * Releases the cache entry of 'sector' held by buffer_cache_get() in
+ * one of the BUFFER_CACHE_META modes, to be written back like any
+ * other entry.
+ */
+void buffer_cache_release (block_sector_t sector);
+
 /**
  * Read SECTOR_SIZE bytes of data starting from the disk sector
  * specified by 'sector', into `target` (user memory address).
@@ -17,7 +66,82 @@ void buffer_cache_read (block_sector_t sector, void *target);
 /**
  * Writes SECTOR_SIZE bytes of data into the disk sector
  * specified by 'sector', from `source` (user memory address).
+ * The sector is not read from disk, even on a cache miss.
  */
 void buffer_cache_write (block_sector_t sector, const void *source);
 
+/* Access modes for pinned buffer cache access. */
+enum buffer_cache_mode
+  {
+    BUFFER_CACHE_READ,          /* The sector is only read. */
+    BUFFER_CACHE_WRITE,         /* The sector is modified in place. */
+    BUFFER_CACHE_OVERWRITE,     /* The whole sector is overwritten, so it is
+                                   not read from disk on a cache miss. */
+    BUFFER_CACHE_META_WRITE,    /* Like BUFFER_CACHE_WRITE and _OVERWRITE, */
+    BUFFER_CACHE_META_OVERWRITE /* for metadata of a journal transaction
+                                   not written to the journal yet. */
+  };
+
+/**
+ * Pins the cache entry holding the disk sector specified by
+ * 'sector', and returns a pointer to its SECTOR_SIZE bytes of data,
+ * which can be accessed in place (without copy) until the matching
+ * buffer_cache_put(). A pinned entry is never evicted.
+ *
+ * In the BUFFER_CACHE_META modes, the entry is held before it is
+ * returned, once a write-back in progress completes: it is neither
+ * written back nor evicted until buffer_cache_release(), so none of
+ * the changes reach the disk before the journal.
+ */
+void *buffer_cache_get (block_sector_t sector, enum buffer_cache_mode mode);
+
+/**
+ * Unpins the cache entry of 'sector' obtained by buffer_cache_get(),
+ * with the same 'mode'. Unless in BUFFER_CACHE_READ mode, the entry
+ * is marked dirty so that it is written back into disk later.
+ */
+void buffer_cache_put (block_sector_t sector, enum buffer_cache_mode mode);
+
+/**
+ * Brings the 'cnt' disk sectors starting at 'sector' into the cache
+ * before they are accessed, reading each run of them that is not
+ * cached yet with a single multi-sector disk request rather than one
+ * request per sector. Returns once the sectors have been read.
+ */
+void buffer_cache_load (block_sector_t sector, size_t cnt);
+
+/**
+ * Asks the read-ahead thread to bring the disk sector specified by
+ * 'sector' into the cache in background, if it is not cached yet.
+ * Returns immediately; the request may be dropped when too many
+ * requests are pending.
+ */
+void buffer_cache_read_ahead (block_sector_t sector);
+
+/* Statistics of the buffer cache, counted since buffer_cache_init(). */
+struct buffer_cache_stats
+  {
+    unsigned long long hits;            /* Accesses to a cached sector. */
+    unsigned long long misses;          /* Accesses that had to fill an entry. */
+    unsigned long long read_aheads;     /* Sectors brought in by read-ahead. */
+    unsigned long long read_ahead_hits; /* Read-ahead sectors accessed later. */
+    unsigned long long evictions;       /* Occupied entries evicted. */
+    unsigned long long clean_evictions; /* Evicted without a write-back. */
+    unsigned long long write_backs;     /* Dirty entries written to disk. */
+    unsigned long long multi_reads;     /* Disk reads of several sectors. */
+    unsigned long long multi_writes;    /* Disk writes of several sectors. */
+    unsigned long long lock_waits;      /* Contended lock acquisitions. */
+    int64_t lock_wait_ticks;            /* Timer ticks spent waiting for
+                                           the buffer cache lock. */
+  };
+
+/**
+ * Copies a consistent snapshot of the buffer cache statistics into
+ * 'stats'. Can be called at any time after buffer_cache_init().
+ */
+void buffer_cache_get_stats (struct buffer_cache_stats *stats);
+
+/* Prints the buffer cache statistics, at shutdown. */
+void buffer_cache_print_stats (void);
+
 #endif
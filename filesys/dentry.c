@@ -0,0 +1,172 @@
+#include "filesys/dentry.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/lock.h"
+
+/* Number of entries in the dentry cache. */
+#define DENTRY_CACHE_SIZE 256
+
+/* A cached directory entry: NAME in the directory at sector DIR,
+   which refers to the inode at SECTOR (or DENTRY_NONE). */
+struct dentry
+  {
+    block_sector_t dir;
+    char name[NAME_MAX + 1];
+    block_sector_t sector;
+    bool used;
+    struct hash_elem helem;             /* Element of dentry_map. */
+    struct list_elem lelem;             /* Element of dentry_lru. */
+  };
+
+/* The entries, allocated statically: the cache never grows. */
+static struct dentry dentries[DENTRY_CACHE_SIZE];
+
+/* A mapping from (directory, name) to the used entries. */
+static struct hash dentry_map;
+
+/* All entries, front: most recently used. Unused ones are at the
+   back, to be reused first. */
+static struct list dentry_lru;
+
+/* Advanced by every dentry_insert(), so that a search on a miss
+   does not cache an entry changed while it was going on. */
+static unsigned dentry_gen;
+
+/* Protects the above. */
+static struct lock dentry_lock;
+
+static struct dentry *dentry_find (block_sector_t, const char *);
+static void dentry_store (block_sector_t, const char *, block_sector_t);
+static unsigned dentry_hash_func (const struct hash_elem *, void *);
+static bool dentry_less_func (const struct hash_elem *,
+                              const struct hash_elem *, void *);
+
+void
+dentry_init (void)
+{
+  size_t i;
+
+  lock_init (&dentry_lock);
+  dentry_gen = 0;
+  hash_init (&dentry_map, dentry_hash_func, dentry_less_func, NULL);
+  list_init (&dentry_lru);
+  for (i = 0; i < DENTRY_CACHE_SIZE; i++) {
+    dentries[i].used = false;
+    list_push_back (&dentry_lru, &dentries[i].lelem);
+  }
+}
+
+void
+dentry_done (void)
+{
+  hash_destroy (&dentry_map, NULL);
+}
+
+bool
+dentry_lookup (block_sector_t dir, const char *name, block_sector_t *sector)
+{
+  bool hit = false;
+
+  lock_acquire (&dentry_lock);
+  struct dentry *d = dentry_find (dir, name);
+  if (d != NULL) {
+    hit = true;
+    *sector = d->sector;
+    list_remove (&d->lelem);
+    list_push_front (&dentry_lru, &d->lelem);
+  }
+  lock_release (&dentry_lock);
+  return hit;
+}
+
+void
+dentry_insert (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  lock_acquire (&dentry_lock);
+  dentry_gen ++;
+  dentry_store (dir, name, sector);
+  lock_release (&dentry_lock);
+}
+
+unsigned
+dentry_generation (void)
+{
+  lock_acquire (&dentry_lock);
+  unsigned gen = dentry_gen;
+  lock_release (&dentry_lock);
+  return gen;
+}
+
+void
+dentry_fill (block_sector_t dir, const char *name, block_sector_t sector,
+             unsigned gen)
+{
+  lock_acquire (&dentry_lock);
+  if (gen == dentry_gen)
+    dentry_store (dir, name, sector);
+  lock_release (&dentry_lock);
+}
+
+/* Caches that NAME in the directory at sector DIR refers to SECTOR.
+   Must be called with dentry_lock held. */
+static void
+dentry_store (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  // such names never exist, and are not worth caching.
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  struct dentry *d = dentry_find (dir, name);
+  if (d == NULL) {
+    // reuse the least recently used entry
+    d = list_entry (list_back (&dentry_lru), struct dentry, lelem);
+    if (d->used)
+      hash_delete (&dentry_map, &d->helem);
+    d->dir = dir;
+    strlcpy (d->name, name, sizeof d->name);
+    d->used = true;
+    hash_insert (&dentry_map, &d->helem);
+  }
+  d->sector = sector;
+  list_remove (&d->lelem);
+  list_push_front (&dentry_lru, &d->lelem);
+}
+
+/* Returns the entry for NAME in the directory at sector DIR, or a null
+   pointer if it is not cached. Must be called with dentry_lock held. */
+static struct dentry *
+dentry_find (block_sector_t dir, const char *name)
+{
+  // hash lookup : a temporary entry
+  struct dentry key;
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+
+  struct hash_elem *h = hash_find (&dentry_map, &key.helem);
+  if (h == NULL)
+    return NULL;
+  return hash_entry (h, struct dentry, helem);
+}
+
+static unsigned
+dentry_hash_func (const struct hash_elem *elem, void *aux UNUSED)
+{
+  struct dentry *d = hash_entry (elem, struct dentry, helem);
+  return hash_string (d->name) ^ hash_int ((int) d->dir);
+}
+
+static bool
+dentry_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  struct dentry *a_dentry = hash_entry (a, struct dentry, helem);
+  struct dentry *b_dentry = hash_entry (b, struct dentry, helem);
+  if (a_dentry->dir != b_dentry->dir)
+    return a_dentry->dir < b_dentry->dir;
+  return strcmp (a_dentry->name, b_dentry->name) < 0;
+}
@@ -0,0 +1,45 @@
+#ifndef FILESYS_DENTRY_H
+#define FILESYS_DENTRY_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Dentry Cache. */
+
+/* Sector cached for a name that is known not to exist. */
+#define DENTRY_NONE ((block_sector_t) -1)
+
+void dentry_init (void);
+void dentry_done (void);
+
+/**
+ * Looks up NAME in the directory at sector DIR. On a hit, sets
+ * *SECTOR to the sector of its inode, or to DENTRY_NONE if there is
+ * no such entry, and returns true. Returns false on a miss.
+ */
+bool dentry_lookup (block_sector_t dir, const char *name,
+                    block_sector_t *sector);
+
+/**
+ * Records that NAME in the directory at sector DIR refers to
+ * SECTOR, which may be DENTRY_NONE. Must be called on every change
+ * of a directory entry, for the cache to remain consistent.
+ */
+void dentry_insert (block_sector_t dir, const char *name,
+                    block_sector_t sector);
+
+/**
+ * Returns the generation of the cache, which every dentry_insert()
+ * advances. To be taken before searching a directory on a miss.
+ */
+unsigned dentry_generation (void);
+
+/**
+ * Caches the result of searching a directory on a miss, like
+ * dentry_insert(), unless a directory entry has changed since
+ * dentry_generation() returned GEN: the search may have missed it.
+ */
+void dentry_fill (block_sector_t dir, const char *name,
+                  block_sector_t sector, unsigned gen);
+
+#endif /* filesys/dentry.h */
@@ -1,8 +1,12 @@
 #include "threads/thread.h"
 #include "filesys/directory.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include "filesys/dentry.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -20,47 +24,79 @@ struct dir_entry
     block_sector_t inode_sector;        /* Sector number of header. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
     bool in_use;                        /* In use or free? */
+    bool is_dir;                        /* Is it a directory? */
   };
 
+/* A directory is an array of entries, the first of which is for its
+   parent directory. Once it grows past DIR_INDEX_THRESHOLD entries, it
+   is converted into an indexed directory: the first entry is followed
+   by a struct dir_index, and the entries are kept in a hash table of
+   buckets, one sector each, starting at sector `first` of the
+   directory. A lookup reads the bucket its name hashes into, and the
+   overflow buckets chained to it.
+   The table grows by linear hashing: once the buckets are 3/4 full on
+   average, each addition splits one more bucket in two, in order, so
+   that no operation rewrites more than a few sectors. The overflow
+   buckets are laid out past the room for DIR_MAX_BUCKETS buckets. */
+#define DIR_INDEX_THRESHOLD 50
+
+/* Marks an indexed directory. It takes the place of the sector number
+   of the second entry of a plain directory, and is larger than any. */
+#define DIR_INDEX_MAGIC 0x58444e49
+
+/* Number of entries in a bucket. */
+#define DIR_BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Number of buckets of a new index, at least, and at most. */
+#define DIR_MIN_BUCKETS 4
+#define DIR_MAX_BUCKETS 8192
+
+/* Header of an indexed directory, at offset 0. */
+struct dir_index
+  {
+    struct dir_entry parent;            /* Parent directory. */
+    uint32_t magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t first;                     /* Sector index of bucket 0. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t entry_cnt;                 /* Number of entries in use. */
+    uint32_t overflow_cnt;              /* Number of overflow buckets. */
+  };
 
-/*
- * Split path.
- * directory and filename should be preallocated buffers.
- */
-void
-split_path_filename(const char *path,
-    char *directory, char *filename)
-{
-  int l = strlen(path);
-  char *s = (char*) malloc( sizeof(char) * (l + 1) );
-  memcpy (s, path, sizeof(char) * (l + 1));
-
-  // absolute path handling
-  char *dir = directory;
-  if(l > 0 && path[0] == '/') {
-    if(dir) *dir++ = '/';
-  }
-
-  // tokenize
-  char *token, *p, *last_token = "";
-  for (token = strtok_r(s, "/", &p); token != NULL;
-       token = strtok_r(NULL, "/", &p))
+/* A bucket of an indexed directory. */
+struct dir_bucket
   {
-    // append last_token into directory
-    int tl = strlen (last_token);
-    if (dir && tl > 0) {
-      memcpy (dir, last_token, sizeof(char) * tl);
-      dir[tl] = '/';
-      dir += tl + 1;
-    }
+    struct dir_entry entries[DIR_BUCKET_ENTRIES];
+    uint32_t next;                      /* Overflow bucket chained, or 0. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - DIR_BUCKET_ENTRIES
+                   * sizeof (struct dir_entry) - sizeof (uint32_t)];
+  };
 
-    last_token = token;
-  }
+static struct dir *open_path (const char *, char name[NAME_MAX + 1]);
+static bool lookup_sector (const struct dir *, block_sector_t, const char *,
+                           block_sector_t *);
+static bool read_index (const struct dir *, struct dir_index *);
+static bool index_build (struct dir *, struct dir_index *);
+static bool index_add (struct dir *, struct dir_index *,
+                       const struct dir_entry *);
 
-  if(dir) *dir = '\0';
-  memcpy (filename, last_token, sizeof(char) * (strlen(last_token) + 1));
-  free (s);
 
+/*
+ * Returns the first component of PATH, skipping the slashes before it,
+ * and sets *LEN to its length. Returns NULL if there is none left.
+ * The component is not null-terminated: it is a span of PATH.
+ * To iterate over the components of PATH,
+ *
+ *   for (name = path_next (path, &len); name != NULL;
+ *        name = path_next (name + len, &len))
+ */
+const char *
+path_next (const char *path, size_t *len)
+{
+  path += strspn (path, "/");
+  if (*path == '\0')
+    return NULL;
+  *len = strcspn (path, "/");
+  return path;
 }
 
 
@@ -78,6 +114,7 @@ dir_create (block_sector_t sector, size_t entry_cnt)
   struct dir *dir = dir_open( inode_open(sector) );
   ASSERT (dir != NULL);
   struct dir_entry e;
+  memset (&e, 0, sizeof e);
   e.inode_sector = sector;
   if (inode_write_at(dir->inode, &e, sizeof e, 0) != sizeof e) {
     success = false;
@@ -119,45 +156,60 @@ dir_open_root (void)
 struct dir *
 dir_open_path (const char *path)
 {
-  // copy of path, to tokenize
-  int l = strlen(path);
-  char s[l + 1];
-  strlcpy(s, path, l + 1);
+  return open_path (path, NULL);
+}
+
+/* Opens the directory that contains the last component of PATH,
+   and copies that component into NAME (an empty string if PATH
+   has no components, e.g. "/"). Returns a null pointer if the
+   directory does not exist, or if a component is too long. */
+struct dir *
+dir_open_parent (const char *path, char name[NAME_MAX + 1])
+{
+  return open_path (path, name);
+}
 
+/* Walks PATH and opens the directory it leads to, or its parent
+   if NAME is not NULL (see dir_open_parent()).
+   The path is walked in place, without copying it. */
+static struct dir *
+open_path (const char *path, char name[NAME_MAX + 1])
+{
   // relative path handling
-  struct dir *curr;
-  if(path[0] == '/') { // absolute path
-    curr = dir_open_root();
-  }
-  else { // relative path
+  block_sector_t sector = ROOT_DIR_SECTOR;
+  if(path[0] != '/') { // relative path
     struct thread *t = thread_current();
-    if (t->cwd == NULL) // may happen for non-process threads (e.g. main)
-      curr = dir_open_root();
-    else {
-      curr = dir_reopen( t->cwd );
-    }
+    if (t->cwd != NULL) // may be NULL for non-process threads (e.g. main)
+      sector = inode_get_inumber( dir_get_inode(t->cwd) );
   }
 
-  // tokenize, and traverse the tree
-  char *token, *p;
-  for (token = strtok_r(s, "/", &p); token != NULL;
-       token = strtok_r(NULL, "/", &p))
+  // traverse the tree by sector numbers: through the dentry cache,
+  // directories are opened only to be searched.
+  char component[NAME_MAX + 1];
+  const char *p;
+  size_t len, next_len;
+  if (name != NULL)
+    name[0] = '\0';
+  for (p = path_next (path, &len); p != NULL; p = path_next (p + len, &len))
   {
-    struct inode *inode = NULL;
-    if(! dir_lookup(curr, token, &inode)) {
-      dir_close(curr);
-      return NULL; // such directory not exist
-    }
-
-    struct dir *next = dir_open(inode);
-    if(next == NULL) {
-      dir_close(curr);
-      return NULL;
+    if (len > NAME_MAX)
+      return NULL; // no such name
+    memcpy (component, p, len);
+    component[len] = '\0';
+
+    if (name != NULL && path_next (p + len, &next_len) == NULL) {
+      // the last component is left for the caller
+      memcpy (name, component, len + 1);
+      break;
     }
-    dir_close(curr);
-    curr = next;
+    if(! lookup_sector(NULL, sector, component, &sector))
+      return NULL; // such directory not exist
   }
 
+  struct dir *curr = dir_open( inode_open(sector) );
+  if (curr == NULL)
+    return NULL;
+
   // prevent from opening removed directories
   if (inode_is_removed (dir_get_inode(curr))) {
     dir_close(curr);
@@ -194,6 +246,88 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Returns the offset of the first entry of BUCKET in an indexed
+   directory. */
+static off_t
+bucket_ofs (const struct dir_index *index, uint32_t bucket)
+{
+  return (off_t) (index->first + bucket) * BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the largest power of 2 not above the number of buckets of
+   INDEX. */
+static uint32_t
+index_level (const struct dir_index *index)
+{
+  uint32_t level = 1;
+  while (level * 2 <= index->bucket_cnt)
+    level *= 2;
+  return level;
+}
+
+/* Returns the bucket that NAME hashes into: the hash modulo twice the
+   level of INDEX, or modulo the level if that bucket is yet to be
+   split off. */
+static uint32_t
+name_bucket (const struct dir_index *index, const char *name)
+{
+  uint32_t hash = hash_string (name);
+  uint32_t level = index_level (index);
+  uint32_t b = hash & (2 * level - 1);
+  return b < index->bucket_cnt ? b : hash & (level - 1);
+}
+
+/* Returns the overflow bucket chained to bucket B, or 0 if there is
+   none (or on a read error): bucket 0 is never an overflow bucket. */
+static uint32_t
+bucket_next (const struct dir *dir, const struct dir_index *index,
+             uint32_t b)
+{
+  uint32_t next;
+  off_t ofs = bucket_ofs (index, b) + offsetof (struct dir_bucket, next);
+
+  if (inode_read_at (dir->inode, &next, sizeof next, ofs) != sizeof next)
+    return 0;
+  return next;
+}
+
+/* Returns POS if it is that of an entry of a bucket of INDEX, or else
+   the position of the next one: the buckets are read in order, the
+   ones of the table and then the overflow ones. */
+static off_t
+index_pos (const struct dir_index *index, off_t pos)
+{
+  if (pos < bucket_ofs (index, 0))
+    return bucket_ofs (index, 0);
+  if (pos % BLOCK_SECTOR_SIZE
+      > (off_t) ((DIR_BUCKET_ENTRIES - 1) * sizeof (struct dir_entry)))
+    pos = ROUND_UP (pos, BLOCK_SECTOR_SIZE);
+  if (pos >= bucket_ofs (index, index->bucket_cnt)
+      && pos < bucket_ofs (index, DIR_MAX_BUCKETS))
+    pos = bucket_ofs (index, DIR_MAX_BUCKETS);
+  return pos;
+}
+
+/* Searches the entries of DIR in [OFS, END) for NAME, as lookup(). */
+static bool
+lookup_span (const struct dir *dir, const char *name, off_t ofs, off_t end,
+             struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_entry e;
+
+  for (; ofs < end && inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use && !strcmp (name, e.name))
+      {
+        if (ep != NULL)
+          *ep = e;
+        if (ofsp != NULL)
+          *ofsp = ofs;
+        return true;
+      }
+  return false;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -203,23 +337,28 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_index index;
+  uint32_t b;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = sizeof e; /* 0-pos is for parent directory */
-       inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.in_use && !strcmp (name, e.name))
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
+  if (!read_index (dir, &index))
+    return lookup_span (dir, name, sizeof (struct dir_entry),
+                        inode_length (dir->inode), ep, ofsp);
+
+  // only the bucket of the name, and its overflow buckets
+  b = name_bucket (&index, name);
+  do
+    {
+      off_t ofs = bucket_ofs (&index, b);
+      if (lookup_span (dir, name, ofs,
+                       ofs + DIR_BUCKET_ENTRIES * sizeof (struct dir_entry),
+                       ep, ofsp))
         return true;
-      }
+      b = bucket_next (dir, &index, b);
+    }
+  while (b != 0);
   return false;
 }
 
@@ -228,8 +367,12 @@ bool
 dir_is_empty (const struct dir *dir)
 {
   struct dir_entry e;
+  struct dir_index index;
   off_t ofs;
 
+  if (read_index (dir, &index))
+    return index.entry_cnt == 0;
+
   for (ofs = sizeof e; /* 0-pos is for parent directory */
        inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
@@ -248,7 +391,7 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
-  struct dir_entry e;
+  block_sector_t sector;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
@@ -257,19 +400,60 @@ dir_lookup (const struct dir *dir, const char *name,
     // current directory
     *inode = inode_reopen (dir->inode);
   }
-  else if (strcmp (name, "..") == 0) {
+  else if (lookup_sector (dir, inode_get_inumber (dir->inode), name, &sector))
+    *inode = inode_open (sector);
+  else
+    *inode = NULL;
+
+  return *inode != NULL;
+}
+
+/* Searches the directory at sector DIR_SECTOR for NAME, which may be
+   "." or "..", first in the dentry cache. DIR is that directory if it
+   is open, or a null pointer to open it on a cache miss.
+   On success, sets *SECTOR to the sector of the entry and returns
+   true; returns false if there is no such entry. */
+static bool
+lookup_sector (const struct dir *dir, block_sector_t dir_sector,
+               const char *name, block_sector_t *sector)
+{
+  struct dir_entry e;
+  bool found;
+
+  if (strcmp (name, ".") == 0) {
+    *sector = dir_sector;
+    return true;
+  }
+  // (taken first: an entry added or removed from now on is not cached
+  // from the search below, which may have missed it)
+  unsigned gen = dentry_generation ();
+  if (dentry_lookup (dir_sector, name, sector))
+    return *sector != DENTRY_NONE;
+
+  // (a temporary directory, not to allocate one)
+  struct dir opened;
+  opened.inode = NULL;
+  if (dir == NULL) {
+    opened.inode = inode_open (dir_sector);
+    opened.pos = 0;
+    if (opened.inode == NULL)
+      return false;
+    dir = &opened;
+  }
+
+  if (strcmp (name, "..") == 0) {
     // parent directory : the information is stored at the first (0-pos) entry.
-    inode_read_at (dir->inode, &e, sizeof e, 0);
-    *inode = inode_open (e.inode_sector);
+    found = inode_read_at (dir->inode, &e, sizeof e, 0) == sizeof e;
   }
-  else if (lookup (dir, name, &e, NULL)) {
+  else {
     // normal lookup. lookuped entry is stored into e
-    *inode = inode_open (e.inode_sector);
+    found = lookup (dir, name, &e, NULL);
   }
-  else
-    *inode = NULL;
+  inode_close (opened.inode);
 
-  return *inode != NULL;
+  *sector = found ? e.inode_sector : DENTRY_NONE;
+  dentry_fill (dir_sector, name, *sector, gen);
+  return found;
 }
 
 /* Adds a file named NAME to DIR, which must not already contain a
@@ -298,38 +482,61 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
     goto done;
 
   // update the child directory [inode_sector] has a parent directory [dir]
+  // (only the sector number of its parent entry: the rest of its first
+  // entry is left alone)
   if (is_dir)
   {
-    /* e is a parent-directory-entry here */
     struct dir *child_dir = dir_open( inode_open(inode_sector) );
     if(child_dir == NULL) goto done;
-    e.inode_sector = inode_get_inumber( dir_get_inode(dir) );
-    if (inode_write_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
+    block_sector_t parent = inode_get_inumber( dir_get_inode(dir) );
+    if (inode_write_at(child_dir->inode, &parent, sizeof parent, 0) != sizeof parent) {
       dir_close (child_dir);
       goto done;
     }
     dir_close (child_dir);
   }
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
+  struct dir_entry new_entry;
+  memset (&new_entry, 0, sizeof new_entry);
+  new_entry.in_use = true;
+  strlcpy (new_entry.name, name, sizeof new_entry.name);
+  new_entry.inode_sector = inode_sector;
+  new_entry.is_dir = is_dir;
 
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  struct dir_index index;
+  if (!read_index (dir, &index))
+  {
+    /* Set OFS to offset of free slot.
+       If there are no free slots, then it will be set to the
+       current end-of-file.
+
+       inode_read_at() will only return a short read at end of file.
+       Otherwise, we'd need to verify that we didn't get a short
+       read due to something intermittent such as low memory. */
+    for (ofs = sizeof e; /* 0-pos is for parent directory */
+         inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+         ofs += sizeof e)
+      if (!e.in_use)
+        break;
+
+    /* Write slot, unless the directory grows too large to be searched
+       linearly: then it is converted into an indexed one. */
+    if (ofs / (off_t) sizeof e <= DIR_INDEX_THRESHOLD) {
+      success = inode_write_at (dir->inode, &new_entry, sizeof new_entry, ofs)
+                == sizeof new_entry;
+      goto done;
+    }
+    if (!index_build (dir, &index))
+      goto done;
+  }
+  success = index_add (dir, &index, &new_entry);
 
  done:
+  if (success) {
+    dentry_insert (inode_get_inumber (dir->inode), name, inode_sector);
+    if (is_dir)
+      dentry_insert (inode_sector, "..", inode_get_inumber (dir->inode));
+  }
   return success;
 }
 
@@ -369,6 +576,12 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
+  dentry_insert (inode_get_inumber (dir->inode), name, DENTRY_NONE);
+  struct dir_index index;
+  if (read_index (dir, &index)) {
+    index.entry_cnt --;
+    inode_write_at (dir->inode, &index, sizeof index, 0);
+  }
 
   /* Remove inode. */
   inode_remove (inode);
@@ -386,9 +599,16 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  struct dir_index index;
+  bool indexed = read_index (dir, &index);
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
+  while (true)
     {
+      // an indexed directory is read bucket by bucket
+      if (indexed)
+        dir->pos = index_pos (&index, dir->pos);
+      if (inode_read_at (dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+        return false;
       dir->pos += sizeof e;
       if (e.in_use)
         {
@@ -396,5 +616,300 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
           return true;
         }
     }
-  return false;
+}
+
+/* Reads up to CNT entries of DIR, from its current position,
+   into RECORDS. Returns the number of entries read, which is 0
+   once the directory contains no more entries.
+   The entries are read a sector at a time. */
+size_t
+dir_readdir_batch (struct dir *dir, struct readdir_record records[],
+                   size_t cnt)
+{
+  struct dir_index index;
+  bool indexed = read_index (dir, &index);
+  size_t n = 0;
+
+  struct dir_entry *entries = malloc (DIR_BUCKET_ENTRIES * sizeof *entries);
+  if (entries == NULL)
+    return 0;
+
+  // 0-pos is for parent directory
+  if (dir->pos < (off_t) sizeof *entries)
+    dir->pos = sizeof *entries;
+
+  while (n < cnt)
+    {
+      // the entries up to the end of the bucket, or a sector's worth
+      off_t end = dir->pos + DIR_BUCKET_ENTRIES * sizeof *entries;
+      if (indexed)
+        {
+          dir->pos = index_pos (&index, dir->pos);
+          end = (ROUND_DOWN (dir->pos, BLOCK_SECTOR_SIZE)
+                 + DIR_BUCKET_ENTRIES * sizeof *entries);
+        }
+      size_t entry_cnt = inode_read_at (dir->inode, entries, end - dir->pos,
+                                        dir->pos) / sizeof *entries;
+      if (entry_cnt == 0)
+        break;
+
+      size_t i;
+      for (i = 0; i < entry_cnt && n < cnt; i++)
+        if (entries[i].in_use)
+          {
+            records[n].inumber = entries[i].inode_sector;
+            records[n].is_dir = entries[i].is_dir;
+            strlcpy (records[n].name, entries[i].name, NAME_MAX + 1);
+            n++;
+          }
+      dir->pos += i * sizeof *entries;
+    }
+
+  free (entries);
+  return n;
+}
+
+/* Sets the position of DIR to POS, as returned by dir_tell(). */
+void
+dir_seek (struct dir *dir, off_t pos)
+{
+  dir->pos = pos;
+}
+
+/* Returns the position of the next entry dir_readdir() reads. */
+off_t
+dir_tell (struct dir *dir)
+{
+  return dir->pos;
+}
+
+/* Indexed directories */
+
+/* Reads the header of DIR into *INDEX, and returns true if DIR is an
+   indexed directory, or false if it is a plain one. */
+static bool
+read_index (const struct dir *dir, struct dir_index *index)
+{
+  return (inode_read_at (dir->inode, index, sizeof *index, 0) == sizeof *index
+          && index->magic == DIR_INDEX_MAGIC);
+}
+
+/* Writes zeros over the buckets [FIRST, LAST) of INDEX, which also
+   allocates their sectors: once this succeeds, writing entries into
+   them never fails for lack of disk space. */
+static bool
+clear_buckets (struct dir *dir, const struct dir_index *index,
+               uint32_t first, uint32_t last)
+{
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+  uint32_t b;
+
+  for (b = first; b < last; b++)
+    if (inode_write_at (dir->inode, zeros, BLOCK_SECTOR_SIZE,
+                        bucket_ofs (index, b)) != BLOCK_SECTOR_SIZE)
+      return false;
+  return true;
+}
+
+/* Reads bucket B of INDEX into *BUCKET. */
+static bool
+read_bucket (const struct dir *dir, const struct dir_index *index,
+             uint32_t b, struct dir_bucket *bucket)
+{
+  return (inode_read_at (dir->inode, bucket, sizeof *bucket,
+                         bucket_ofs (index, b)) == sizeof *bucket);
+}
+
+/* Writes *BUCKET over bucket B of INDEX. */
+static bool
+write_bucket (struct dir *dir, const struct dir_index *index,
+              uint32_t b, const struct dir_bucket *bucket)
+{
+  return (inode_write_at (dir->inode, bucket, sizeof *bucket,
+                          bucket_ofs (index, b)) == sizeof *bucket);
+}
+
+/* Adds entry E into the indexed directory DIR, in the first free slot
+   of its bucket and the overflow buckets chained to it, or else into a
+   new overflow bucket chained at the end. Updates *INDEX, but does not
+   write it. */
+static bool
+index_insert (struct dir *dir, struct dir_index *index,
+              const struct dir_entry *e)
+{
+  struct dir_bucket *bucket;
+  uint32_t b = name_bucket (index, e->name), next;
+  off_t ofs;
+  bool success = false;
+  size_t i;
+
+  bucket = malloc (sizeof *bucket);
+  if (bucket == NULL)
+    return false;
+
+  while (true) {
+    if (!read_bucket (dir, index, b, bucket))
+      goto done;
+    for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+      if (!bucket->entries[i].in_use) {
+        ofs = bucket_ofs (index, b) + i * sizeof *e;
+        success = inode_write_at (dir->inode, e, sizeof *e, ofs) == sizeof *e;
+        goto done;
+      }
+    if (bucket->next == 0)
+      break;
+    b = bucket->next;
+  }
+
+  // the new overflow bucket is written before it is chained to B
+  next = DIR_MAX_BUCKETS + index->overflow_cnt;
+  memset (bucket, 0, sizeof *bucket);
+  bucket->entries[0] = *e;
+  ofs = bucket_ofs (index, b) + offsetof (struct dir_bucket, next);
+  if (!write_bucket (dir, index, next, bucket)
+      || inode_write_at (dir->inode, &next, sizeof next, ofs) != sizeof next)
+    goto done;
+  index->overflow_cnt ++;
+  success = true;
+
+ done:
+  if (success)
+    index->entry_cnt ++;
+  free (bucket);
+  return success;
+}
+
+/* Converts the plain directory DIR into an indexed one, described by
+   *INDEX on return. The buckets are laid out after the existing
+   entries and filled in before the header is written, so DIR is left
+   as it was on failure (maybe with free slots appended). */
+static bool
+index_build (struct dir *dir, struct dir_index *index)
+{
+  struct dir_entry e;
+  struct dir_entry *entries;
+  size_t cnt = 0, i;
+  off_t ofs, length = inode_length (dir->inode);
+  bool success = false;
+
+  entries = malloc (length);
+  if (entries == NULL)
+    return false;
+  for (ofs = sizeof e;
+       inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use)
+      entries[cnt++] = e;
+
+  memset (index, 0, sizeof *index);
+  if (inode_read_at (dir->inode, &index->parent, sizeof index->parent, 0)
+      != sizeof index->parent)
+    goto done;
+  index->magic = DIR_INDEX_MAGIC;
+  index->first = DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE);
+  index->bucket_cnt = DIR_MIN_BUCKETS;
+  while (index->bucket_cnt * DIR_BUCKET_ENTRIES < 2 * cnt)
+    index->bucket_cnt *= 2;
+  if (!clear_buckets (dir, index, 0, index->bucket_cnt))
+    goto done;
+  for (i = 0; i < cnt; i++)
+    if (!index_insert (dir, index, &entries[i]))
+      goto done;
+
+  // the directory is indexed from now on
+  success = (inode_write_at (dir->inode, index, sizeof *index, 0)
+             == sizeof *index);
+
+ done:
+  free (entries);
+  return success;
+}
+
+/* Splits the next bucket of the indexed directory DIR in linear order,
+   S, into S and a new bucket: the entries of S and of its overflow
+   buckets that hash into the new one are moved there. They are written
+   there and the header is written before they are cleared in S, so no
+   entry is lost on failure. */
+static bool
+index_split (struct dir *dir, struct dir_index *index)
+{
+  struct dir_index split = *index;
+  struct dir_bucket *from, *into;
+  uint32_t s = index->bucket_cnt - index_level (index);
+  uint32_t b, to = index->bucket_cnt;
+  size_t i, n = 0;
+  bool success = false;
+
+  if (index->bucket_cnt >= DIR_MAX_BUCKETS)
+    return true; // only chains grow from now on
+  split.bucket_cnt ++;
+
+  from = malloc (sizeof *from);
+  into = calloc (1, sizeof *into);
+  if (from == NULL || into == NULL)
+    goto done;
+
+  // copy the moving entries into the new bucket, and overflow buckets
+  // chained to it when they don't fit
+  b = s;
+  do {
+    if (!read_bucket (dir, index, b, from))
+      goto done;
+    for (i = 0; i < DIR_BUCKET_ENTRIES; i++) {
+      if (!from->entries[i].in_use
+          || name_bucket (&split, from->entries[i].name) == s)
+        continue;
+      if (n == DIR_BUCKET_ENTRIES) {
+        into->next = DIR_MAX_BUCKETS + split.overflow_cnt ++;
+        if (!write_bucket (dir, &split, to, into))
+          goto done;
+        to = into->next;
+        memset (into, 0, sizeof *into);
+        n = 0;
+      }
+      into->entries[n++] = from->entries[i];
+    }
+    b = from->next;
+  } while (b != 0);
+  if (!write_bucket (dir, &split, to, into)
+      || inode_write_at (dir->inode, &split, sizeof split, 0) != sizeof split)
+    goto done;
+  *index = split;
+
+  // then, clear them where they were
+  b = s;
+  do {
+    bool moved = false;
+    if (!read_bucket (dir, index, b, from))
+      goto done;
+    for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+      if (from->entries[i].in_use
+          && name_bucket (index, from->entries[i].name) != s) {
+        from->entries[i].in_use = false;
+        moved = true;
+      }
+    if (moved && !write_bucket (dir, index, b, from))
+      goto done;
+    b = from->next;
+  } while (b != 0);
+  success = true;
+
+ done:
+  free (from);
+  free (into);
+  return success;
+}
+
+/* Adds entry E into the indexed directory DIR, splitting one bucket
+   first if the buckets are 3/4 full on average. */
+static bool
+index_add (struct dir *dir, struct dir_index *index,
+           const struct dir_entry *e)
+{
+  if (index->entry_cnt >= index->bucket_cnt * DIR_BUCKET_ENTRIES * 3 / 4
+      && !index_split (dir, index))
+    return false;
+  return (index_insert (dir, index, e)
+          && inode_write_at (dir->inode, index, sizeof *index, 0)
+             == sizeof *index);
 }
@@ -3,7 +3,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <readdir.h>
 #include "devices/block.h"
+#include "filesys/off_t.h"
 
 /* Maximum length of a file name component.
    This is the traditional UNIX maximum length.
@@ -13,14 +15,21 @@
 
 struct inode;
 
+/* dir_readdir_batch() reads entries as the readdir_batch system call
+   writes them. */
+#if READDIR_MAX_LEN != NAME_MAX
+#error "readdir_record names must hold NAME_MAX characters"
+#endif
+
 /* Directory and Path manipulation utilities. */
-void split_path_filename(const char *path, char *directory, char *filename);
+const char *path_next (const char *path, size_t *len);
 
 /* Opening and closing directories. */
 bool dir_create (block_sector_t sector, size_t entry_cnt);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
 struct dir *dir_open_path (const char *);
+struct dir *dir_open_parent (const char *, char name[NAME_MAX + 1]);
 struct dir *dir_reopen (struct dir *);
 void dir_close (struct dir *);
 struct inode *dir_get_inode (struct dir *);
@@ -31,5 +40,8 @@ bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, block_sector_t, bool is_dir);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdir_batch (struct dir *, struct readdir_record *, size_t cnt);
+void dir_seek (struct dir *, off_t);
+off_t dir_tell (struct dir *);
 
 #endif /* filesys/directory.h */
@@ -113,6 +113,15 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Writes the data and the metadata of FILE to disk, so that they
+   survive a crash.  Returns false on a write error. */
+bool
+file_sync (struct file *file)
+{
+  ASSERT (file != NULL);
+  return inode_sync (file->inode);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
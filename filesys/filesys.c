@@ -1,6 +1,7 @@
 #include "threads/thread.h"
 #include "filesys/filesys.h"
 #include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
@@ -24,13 +26,16 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dentry_init ();
   free_map_init ();
+  journal_init ();
 
   buffer_cache_init ();
 
   if (format)
     do_format ();
 
+  journal_open ();
   free_map_open ();
 }
 
@@ -39,7 +44,9 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  journal_close ();
   free_map_close ();
+  dentry_done ();
 
   buffer_cache_close ();
 }
@@ -56,14 +63,23 @@ filesys_create (const char *path, off_t initial_size, bool is_dir)
 {
   block_sector_t inode_sector = 0;
 
+  journal_begin ();
+
   // split path and name
-  char directory[ strlen(path) ];
-  char file_name[ strlen(path) ];
-  split_path_filename(path, directory, file_name);
-  struct dir *dir = dir_open_path (directory);
+  char file_name[NAME_MAX + 1];
+  struct dir *dir = dir_open_parent (path, file_name);
+
+  // a file's inode goes near its directory; a new directory, to a
+  // group with free space, for the files to be created within it.
+  block_sector_t goal = 0;
+  if (dir != NULL) {
+    goal = inode_get_inumber (dir_get_inode (dir));
+    if (is_dir)
+      goal = free_map_spread_goal (goal);
+  }
 
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_extent (1, goal, &inode_sector) == 1
                   && inode_create (inode_sector, initial_size, is_dir)
                   && dir_add (dir, file_name, inode_sector, is_dir));
 
@@ -71,6 +87,7 @@ filesys_create (const char *path, off_t initial_size, bool is_dir)
     free_map_release (inode_sector, 1);
   dir_close (dir);
 
+  journal_end ();
   return success;
 }
 
@@ -82,29 +99,26 @@ filesys_create (const char *path, off_t initial_size, bool is_dir)
 struct file *
 filesys_open (const char *name)
 {
-  int l = strlen(name);
-  if (l == 0) return NULL;
+  if (*name == '\0') return NULL;
 
-  char directory[ l + 1 ];
-  char file_name[ l + 1 ];
-  split_path_filename(name, directory, file_name);
-  struct dir *dir = dir_open_path (directory);
+  char file_name[NAME_MAX + 1];
+  struct dir *dir = dir_open_parent (name, file_name);
   struct inode *inode = NULL;
 
   // removed directory handling
   if (dir == NULL) return NULL;
 
-  if (strlen(file_name) > 0) {
+  if (strlen(file_name) > 0)
     dir_lookup (dir, file_name, &inode);
-    dir_close (dir);
-  }
-  else { // empty filename : just return the directory
-    inode = dir_get_inode (dir);
-  }
+  else // empty filename : just return the directory
+    inode = inode_reopen (dir_get_inode (dir));
+  dir_close (dir);
 
   // removed file handling
-  if (inode == NULL || inode_is_removed (inode))
+  if (inode == NULL || inode_is_removed (inode)) {
+    inode_close (inode);
     return NULL;
+  }
 
   return file_open (inode);
 }
@@ -116,14 +130,15 @@ filesys_open (const char *name)
 bool
 filesys_remove (const char *name)
 {
-  char directory[ strlen(name) ];
-  char file_name[ strlen(name) ];
-  split_path_filename(name, directory, file_name);
-  struct dir *dir = dir_open_path (directory);
+  char file_name[NAME_MAX + 1];
+
+  journal_begin ();
+  struct dir *dir = dir_open_parent (name, file_name);
 
   bool success = (dir != NULL && dir_remove (dir, file_name));
   dir_close (dir);
 
+  journal_end ();
   return success;
 }
 
@@ -143,6 +158,15 @@ filesys_chdir (const char *name)
   return true;
 }
 
+/* Writes all of the data to disk, and commits the metadata, so
+   that they survive a crash.  Returns false on a write error. */
+bool
+filesys_sync (void)
+{
+  buffer_cache_sync_all ();
+  return journal_commit ();
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
@@ -151,6 +175,7 @@ do_format (void)
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_create ();
   free_map_close ();
   printf ("done.\n");
 }
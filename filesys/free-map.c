@@ -1,13 +1,57 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <limits.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/lock.h"
+#include "threads/malloc.h"
+
+/* Number of free map bits held by a sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * CHAR_BIT)
+
+/* The device is divided into groups of GROUP_SIZE sectors.  The
+   number of free sectors is kept per group, so that new directories
+   go to groups with free space. */
+#define GROUP_SIZE 512
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* Sectors of the free map file whose part of the free map has
+   changed since it was last written, one bit per sector.  They
+   are written back by free_map_flush(), rather than the whole free
+   map on every allocation. */
+static struct bitmap *free_map_dirty;
+
+/* Sectors released while metadata is journaled, one bit per
+   sector.  They are still marked used in free_map until the journal
+   is emptied: a sector whose old contents are in the journal must
+   not be reused, or replaying the journal after a crash would write
+   them over its new contents. */
+static struct bitmap *free_map_released;
+
+/* Whether an allocation failed while some sectors were waiting in
+   free_map_released, which might have been enough. */
+static bool free_map_starved;
+
+/* Number of free sectors in each group. */
+static size_t *group_free;
+static size_t group_cnt;
+
+/* Protects free_map, free_map_dirty, free_map_released,
+   free_map_starved, and group_free. */
+static struct lock free_map_lock;
+
+static size_t free_map_scan (size_t start, size_t end, size_t cnt);
+static void free_map_set (block_sector_t, size_t, bool);
+static void free_map_count_groups (void);
+static void free_map_mark_dirty (block_sector_t, size_t);
+static void free_map_note_failure (void);
+
 /* Initializes the free map. */
 void
 free_map_init (void)
@@ -15,38 +59,286 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                                BITS_PER_SECTOR));
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SIZE);
+  free_map_released = bitmap_create (bitmap_size (free_map));
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (free_map_dirty == NULL || free_map_released == NULL
+      || group_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, JOURNAL_SECTOR);
+  free_map_count_groups ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  lock_acquire (&free_map_lock);
+  block_sector_t sector = free_map_scan (0, bitmap_size (free_map), cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
+      free_map_set (sector, cnt, true);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+  else
+    free_map_note_failure ();
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT consecutive sectors from the free map,
+   preferably starting at GOAL, and stores the first into *SECTORP.
+   If GOAL is free, the run starting there is taken, so that a file
+   grows contiguously; otherwise the first run of CNT free sectors
+   after GOAL (wrapping around at the end of the device) is taken,
+   or of CNT/2, CNT/4, ... sectors if there is none that long.
+   Returns the number of sectors allocated, or 0 if the disk is full. */
+size_t
+free_map_allocate_extent (size_t cnt, block_sector_t goal,
+                          block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t sector;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (goal < size && !bitmap_test (free_map, goal))
+    {
+      size_t n = 1;
+      while (n < cnt && goal + n < size && !bitmap_test (free_map, goal + n))
+        n++;
+      sector = goal;
+      cnt = n;
+    }
+  else
+    {
+      if (goal > size)
+        goal = size;
+      for (; cnt > 0; cnt /= 2)
+        {
+          sector = free_map_scan (goal, size, cnt);
+          if (sector == BITMAP_ERROR)
+            sector = free_map_scan (0, goal, cnt);
+          if (sector != BITMAP_ERROR)
+            break;
+        }
+      if (cnt == 0)
+        {
+          free_map_note_failure ();
+          lock_release (&free_map_lock);
+          return 0;
+        }
+    }
+
+  free_map_set (sector, cnt, true);
+  lock_release (&free_map_lock);
+  *sectorp = sector;
+  return cnt;
+}
+
+/* Returns a sector to allocate the inode of a new directory at,
+   whose parent directory's inode is at PARENT: the start of the
+   first group after PARENT's with at least the average number of
+   free sectors.  Directories, and the files within them, spread
+   over the device this way, rather than crowding the groups that
+   filled up first. */
+block_sector_t
+free_map_spread_goal (block_sector_t parent)
+{
+  size_t total = 0, first, g, i;
+
+  lock_acquire (&free_map_lock);
+  for (g = 0; g < group_cnt; g++)
+    total += group_free[g];
+
+  first = parent / GROUP_SIZE;
+  g = first;
+  for (i = 1; i <= group_cnt; i++)
+    {
+      g = (first + i) % group_cnt;
+      if (group_free[g] > 0 && group_free[g] * group_cnt >= total)
+        break;
+    }
+  lock_release (&free_map_lock);
+  return g * GROUP_SIZE;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  While
+   metadata is journaled, that is only once free_map_reclaim() is
+   called. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  if (journal_enabled ())
+    {
+      ASSERT (bitmap_none (free_map_released, sector, cnt));
+      bitmap_set_multiple (free_map_released, sector, cnt, true);
+    }
+  else
+    free_map_set (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Returns whether an allocation has failed since the last
+   free_map_reclaim() while some sectors were waiting for it: the
+   journal is then emptied at the next commit, rather than once it
+   fills up. */
+bool
+free_map_needs_reclaim (void)
+{
+  lock_acquire (&free_map_lock);
+  bool starved = free_map_starved;
+  lock_release (&free_map_lock);
+  return starved;
+}
+
+/* Makes the sectors released so far available for use.  The
+   journal calls it once it is emptied. */
+void
+free_map_reclaim (void)
+{
+  size_t size = bitmap_size (free_map_released);
+  size_t start = 0, end;
+
+  lock_acquire (&free_map_lock);
+  while ((start = bitmap_scan (free_map_released, start, 1, true))
+         != BITMAP_ERROR)
+    {
+      end = bitmap_scan (free_map_released, start, 1, false);
+      if (end == BITMAP_ERROR)
+        end = size;
+      bitmap_set_multiple (free_map_released, start, end - start, false);
+      free_map_set (start, end - start, false);
+      start = end;
+    }
+  free_map_starved = false;
+  lock_release (&free_map_lock);
+}
+
+/* Writes the changed sectors of the free map to the free map
+   file, that is, into the buffer cache.  Called on every tick of
+   the write-behind thread, as the journal commits, and at
+   shutdown.  Returns false if some of them could not be written. */
+bool
+free_map_flush (void)
+{
+  bool success = true;
+  size_t i;
+
+  if (free_map_file == NULL)
+    return true;
+
+  /* Each sector is clean once taken: it is dirtied again if the
+     free map changes while it is written, even by allocating the
+     sectors of the free map file itself.  It is taken within an
+     operation, so that a commit waits for it to be written into
+     the transaction, rather than finding it clean and leaving it
+     out.  (Nested when called by the commit itself.) */
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  while ((i = bitmap_scan_and_flip (free_map_dirty, 0, 1, true))
+         != BITMAP_ERROR)
+    {
+      size_t start = i * BITS_PER_SECTOR;
+      size_t cnt = bitmap_size (free_map) - start;
+      if (cnt > BITS_PER_SECTOR)
+        cnt = BITS_PER_SECTOR;
+
+      lock_release (&free_map_lock);
+      if (!bitmap_write_partial (free_map, free_map_file, start, cnt))
+        success = false;
+      lock_acquire (&free_map_lock);
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
+  return success;
+}
+
+/* Returns the first sector of the first run of CNT free sectors
+   that starts within [START, END), or BITMAP_ERROR if there is
+   none.  Must be called with free_map_lock held. */
+static size_t
+free_map_scan (size_t start, size_t end, size_t cnt)
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+
+  size_t sector = bitmap_scan (free_map, start, cnt, false);
+  return sector < end ? sector : BITMAP_ERROR;
+}
+
+/* Marks the CNT sectors starting at SECTOR as USED or free in the
+   free map, all of which must be the other way around, and
+   accounts for them.  Must be called with free_map_lock held. */
+static void
+free_map_set (block_sector_t sector, size_t cnt, bool used)
+{
+  size_t end = sector + cnt;
+  size_t i, group_end;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  for (i = sector; i < end; i = group_end)
+    {
+      size_t n;
+      group_end = ROUND_DOWN (i, GROUP_SIZE) + GROUP_SIZE;
+      n = (end < group_end ? end : group_end) - i;
+      if (used)
+        group_free[i / GROUP_SIZE] -= n;
+      else
+        group_free[i / GROUP_SIZE] += n;
+    }
+  free_map_mark_dirty (sector, cnt);
+}
+
+/* Records that an allocation failed, which free_map_reclaim()
+   might have helped.  Must be called with free_map_lock held. */
+static void
+free_map_note_failure (void)
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (bitmap_contains (free_map_released, 0,
+                       bitmap_size (free_map_released), true))
+    free_map_starved = true;
+}
+
+/* Counts the free sectors of every group from scratch. */
+static void
+free_map_count_groups (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * GROUP_SIZE;
+      size_t n = size - start < GROUP_SIZE ? size - start : GROUP_SIZE;
+      group_free[g] = bitmap_count (free_map, start, n, false);
+    }
+}
+
+/* Marks the sectors of the free map file holding the CNT bits
+   starting at SECTOR dirty.  Must be called with free_map_lock
+   held. */
+static void
+free_map_mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (cnt > 0)
+    bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +350,18 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (free_map_dirty, false);
+  free_map_count_groups ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void)
 {
+  if (!free_map_flush ())
+    PANIC ("can't write free map");
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -76,10 +373,13 @@ free_map_create (void)
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
+  /* Write bitmap to file. Writing allocates the sectors of the
+     file, which dirties the free map again: free_map_flush() keeps
+     writing until it is clean. */
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  bitmap_set_all (free_map_dirty, true);
+  if (!free_map_flush ())
     PANIC ("can't write free map");
 }
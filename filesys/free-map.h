@@ -10,8 +10,13 @@ void free_map_read (void);
 void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
+bool free_map_flush (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+size_t free_map_allocate_extent (size_t, block_sector_t, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+bool free_map_needs_reclaim (void);
+void free_map_reclaim (void);
+block_sector_t free_map_spread_goal (block_sector_t);
 
 #endif /* filesys/free-map.h */
@@ -1,4 +1,5 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
@@ -6,7 +7,11 @@
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
+#include "threads/condvar.h"
+#include "threads/lock.h"
 #include "threads/malloc.h"
+#include "threads/rwlock.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
@@ -14,16 +19,42 @@
 #define DIRECT_BLOCKS_COUNT 123
 #define INDIRECT_BLOCKS_PER_SECTOR 128
 
+/* Read-ahead window of a sequential reader, in sectors.
+   It starts at the minimum and doubles on every sequential read. */
+#define READ_AHEAD_MIN_WINDOW 2
+#define READ_AHEAD_MAX_WINDOW 32
+
+/* A read spanning several sectors brings them into the buffer cache
+   up to INODE_LOAD_SECTORS sectors at a time, with a disk request per
+   physically contiguous run of them, before copying them out. */
+#define INODE_LOAD_SECTORS 32
+
+/* A write allocates the holes it fills up to INODE_FILL_SECTORS
+   sectors at a time (at most 64, the bits of a mask). */
+#define INODE_FILL_SECTORS 64
+
+/* A file up to INLINE_DATA_SIZE bytes long keeps its data inside the
+   inode, in place of the block pointers, until it grows larger. */
+#define INLINE_DATA_SIZE ((DIRECT_BLOCKS_COUNT + 2) * sizeof (block_sector_t))
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    /** Data sectors */
-    block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
-    block_sector_t indirect_block;
-    block_sector_t doubly_indirect_block;
+    union
+      {
+        struct
+          {
+            /** Data sectors */
+            block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
+            block_sector_t indirect_block;
+            block_sector_t doubly_indirect_block;
+          };
+        uint8_t inline_data[INLINE_DATA_SIZE];  /* Data, if is_inline. */
+      };
 
     bool is_dir;
+    bool is_inline;                     /* Data is in inline_data? */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
   };
@@ -32,9 +63,28 @@ struct inode_indirect_block_sector {
   block_sector_t blocks[INDIRECT_BLOCKS_PER_SECTOR];
 };
 
-static bool inode_allocate (struct inode_disk *disk_inode);
-static bool inode_reserve (struct inode_disk *disk_inode, off_t length);
+/* In-memory copies of the indirect blocks of an inode looked up last,
+   so that looking up the sectors of a large file mostly needs no
+   buffer cache access at all. */
+struct inode_block_map {
+  off_t leaf_base;      // index of the first data sector mapped by `leaf`,
+                        // or -1 if `leaf` is not valid
+  bool doubly_valid;    // whether `doubly` is valid
+  struct inode_indirect_block_sector leaf;    // an indirect block
+                                              // mapping data sectors
+  struct inode_indirect_block_sector doubly;  // the doubly indirect block
+};
+
+static bool inode_is_meta (const struct inode *inode);
+static enum buffer_cache_mode inode_access_mode (const struct inode *,
+                                                 block_sector_t,
+                                                 enum buffer_cache_mode);
+static void inode_write_meta (block_sector_t sector, const void *source);
+static bool inode_reserve (struct inode_disk *disk_inode,
+                           size_t first, size_t last, block_sector_t goal);
 static bool inode_deallocate (struct inode *inode);
+static void inode_read_ahead (struct inode *inode, off_t start, off_t end);
+static void inode_load (struct inode *inode, off_t start, off_t end);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -50,21 +100,164 @@ min (size_t a, size_t b)
   return a < b ? a : b;
 }
 
+/* What open_inodes is keyed on: the sector of an inode. A lookup
+   makes one of these on the stack, rather than a whole inode. */
+struct inode_key
+  {
+    struct hash_elem elem;              /* Element in open_inodes. */
+    block_sector_t sector;              /* Sector number of disk location. */
+  };
+
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
-    block_sector_t sector;              /* Sector number of disk location. */
+    struct inode_key key;               /* Element in open_inodes. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+
+    /* Sequential read detection, for read-ahead. */
+    off_t read_ahead_pos;               /* Offset a sequential read starts at. */
+    size_t read_ahead_window;           /* Sectors to read ahead, 0 if random. */
+    size_t read_ahead_end;              /* Sector index read-ahead is issued up to. */
+
+    block_sector_t alloc_hint;          /* Next-fit hint: the sector after the
+                                           last one allocated, or 0. */
+
+    /* Memoized block map, allocated on the first lookup beyond the
+       direct blocks. Invalidated whenever the inode is extended. */
+    struct inode_block_map *map;
+
+    /* Synchronization. Lock order: a range, then rwlock, then lock. */
+    struct rwlock rwlock;               /* Held for writing to change the length
+                                           or the blocks, and for reading to
+                                           look them up. */
+    struct lock lock;                   /* Protects the block map, the read-ahead
+                                           state, and the list of ranges. */
+    struct list ranges;                 /* Ranges locked by readers and writers. */
+    struct condvar range_unlocked;      /* Broadcast when a range is unlocked. */
+  };
+
+/* A range of an inode's data locked by a reader or a writer, which
+   lives on the stack of the locking thread. Whole sectors are locked,
+   because writing a part of a sector rewrites all of it in the buffer
+   cache. Overlapping ranges exclude each other unless both are read. */
+struct inode_range
+  {
+    off_t start, end;                   /* Sector aligned [start, end). */
+    bool write;                         /* Locked by a writer? */
+    struct list_elem elem;              /* Element in inode's ranges. */
   };
 
+/* Locks the range of SIZE bytes at OFFSET of INODE, for writing if
+   WRITE is true, waiting for the overlapping ranges to be unlocked. */
+static void
+inode_lock_range (struct inode *inode, struct inode_range *range,
+                  off_t offset, off_t size, bool write)
+{
+  range->start = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE);
+  range->end = ROUND_UP (offset + (size > 0 ? size : 0), BLOCK_SECTOR_SIZE);
+  range->write = write;
+
+  lock_acquire (&inode->lock);
+  struct list_elem *e = list_begin (&inode->ranges);
+  while (e != list_end (&inode->ranges)) {
+    struct inode_range *r = list_entry (e, struct inode_range, elem);
+    if ((write || r->write) && r->start < range->end && range->start < r->end) {
+      // conflict: wait, and check all of the ranges again
+      condvar_wait (&inode->range_unlocked, &inode->lock);
+      e = list_begin (&inode->ranges);
+    }
+    else
+      e = list_next (e);
+  }
+  list_push_back (&inode->ranges, &range->elem);
+  lock_release (&inode->lock);
+}
+
+/* Unlocks RANGE of INODE, locked by inode_lock_range(). */
+static void
+inode_unlock_range (struct inode *inode, struct inode_range *range)
+{
+  lock_acquire (&inode->lock);
+  list_remove (&range->elem);
+  condvar_broadcast (&inode->range_unlocked, &inode->lock);
+  lock_release (&inode->lock);
+}
+
+/* Returns the block map of INODE, allocating it if necessary.
+   Returns a null pointer if memory allocation fails.
+   Must be called with INODE's lock held. */
+static struct inode_block_map *
+inode_block_map (struct inode *inode)
+{
+  if (inode->map == NULL) {
+    inode->map = malloc (sizeof *inode->map);
+    if (inode->map != NULL) {
+      inode->map->leaf_base = -1;
+      inode->map->doubly_valid = false;
+    }
+  }
+  return inode->map;
+}
+
+/* Forgets the memoized block map of INODE, whose indirect blocks
+   are about to change. */
+static void
+inode_block_map_invalidate (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+  if (inode->map != NULL) {
+    inode->map->leaf_base = -1;
+    inode->map->doubly_valid = false;
+  }
+  lock_release (&inode->lock);
+}
+
+/* Returns entry INDEX of the indirect block at SECTOR of INODE.
+   If MAP is not null, the block is memoized into it too: as the leaf
+   block mapping the data sectors from LEAF_BASE on, or as the doubly
+   indirect block if LEAF_BASE is -1. */
 static block_sector_t
-index_to_sector (const struct inode_disk *idisk, off_t index)
+indirect_block_lookup (struct inode *inode, block_sector_t sector, off_t index,
+                       struct inode_block_map *map, off_t leaf_base)
 {
+  struct inode_indirect_block_sector *indirect_idisk;
+  block_sector_t ret;
+
+  indirect_idisk = buffer_cache_get (sector, BUFFER_CACHE_READ);
+  ret = indirect_idisk->blocks[index];
+  if (map != NULL) {
+    lock_acquire (&inode->lock);
+    if (leaf_base < 0) {
+      memcpy (&map->doubly, indirect_idisk, sizeof map->doubly);
+      map->doubly_valid = true;
+    }
+    else {
+      memcpy (&map->leaf, indirect_idisk, sizeof map->leaf);
+      map->leaf_base = leaf_base;
+    }
+    lock_release (&inode->lock);
+  }
+  buffer_cache_put (sector, BUFFER_CACHE_READ);
+  return ret;
+}
+
+/* Returns the disk sector holding data sector INDEX of INODE,
+   or 0 if it is a hole (not allocated yet).
+   The indirect blocks on the way are memoized in the block map of
+   INODE, so that consecutive lookups within the range of a single
+   indirect block are just an array access.
+   Must be called with INODE's rwlock held. */
+static block_sector_t
+index_to_sector (struct inode *inode, off_t index)
+{
+  const struct inode_disk *idisk = &inode->data;
   off_t index_base = 0, index_limit = 0;   // base, limit for sector index
+  off_t leaf_base;                         // first index of the leaf block
+  off_t index_first = -1;                  // first level block index, if any
+  block_sector_t leaf = 0;                 // indirect block mapping `index`
   block_sector_t ret;
 
   // (1) direct blocks
@@ -77,73 +270,104 @@ index_to_sector (const struct inode_disk *idisk, off_t index)
   // (2) a single indirect block
   index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR;
   if (index < index_limit) {
-    struct inode_indirect_block_sector *indirect_idisk;
-    indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
-    buffer_cache_read (idisk->indirect_block, indirect_idisk);
-
-    ret = indirect_idisk->blocks[ index - index_base ];
-    free(indirect_idisk);
-
-    return ret;
+    leaf_base = index_base;
   }
-  index_base = index_limit;
+  else {
+    index_base = index_limit;
 
-  // (3) a single doubly indirect block
-  index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR;
-  if (index < index_limit) {
-    // first and second level block index, respecitvely
-    off_t index_first =  (index - index_base) / INDIRECT_BLOCKS_PER_SECTOR;
-    off_t index_second = (index - index_base) % INDIRECT_BLOCKS_PER_SECTOR;
-
-    // fetch two indirect block sectors
-    struct inode_indirect_block_sector *indirect_idisk;
-    indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
+    // (3) a single doubly indirect block
+    index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR;
+    if (index >= index_limit)
+      return -1;  // (4) what up?
 
-    buffer_cache_read (idisk->doubly_indirect_block, indirect_idisk);
-    buffer_cache_read (indirect_idisk->blocks[index_first], indirect_idisk);
-    ret = indirect_idisk->blocks[index_second];
+    index_first = (index - index_base) / INDIRECT_BLOCKS_PER_SECTOR;
+    leaf_base = index_base + index_first * INDIRECT_BLOCKS_PER_SECTOR;
+  }
 
-    free(indirect_idisk);
+  // look the memoized blocks up
+  lock_acquire (&inode->lock);
+  struct inode_block_map *map = inode_block_map (inode);
+  if (map != NULL && map->leaf_base == leaf_base) {
+    ret = map->leaf.blocks[index - leaf_base];
+    lock_release (&inode->lock);
     return ret;
   }
+  bool doubly_valid = (map != NULL && map->doubly_valid);
+  if (index_first >= 0 && doubly_valid)
+    leaf = map->doubly.blocks[index_first];
+  lock_release (&inode->lock);
+
+  // first level
+  if (index_first < 0)
+    leaf = idisk->indirect_block;
+  else if (!doubly_valid && idisk->doubly_indirect_block != 0)
+    leaf = indirect_block_lookup (inode, idisk->doubly_indirect_block,
+                                  index_first, map, -1);
+  if (leaf == 0)
+    return 0;
 
-  // (4) what up?
-  return -1;
+  // second level: memoize the leaf block for the lookups to follow
+  return indirect_block_lookup (inode, leaf, index - leaf_base, map, leaf_base);
 }
 
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or 0 if POS is in a hole of INODE.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos)
+byte_to_sector (struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
   if (0 <= pos && pos < inode->data.length) {
     // sector index
     off_t index = pos / BLOCK_SECTOR_SIZE;
-    return index_to_sector (&inode->data, index);
+    return index_to_sector (inode, index);
   }
   else
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes, and the open_cnt of the inodes in it. */
+static struct lock open_inodes_lock;
+
+static unsigned inode_hash_func (const struct hash_elem *, void *);
+static bool inode_less_func (const struct hash_elem *,
+                             const struct hash_elem *, void *);
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash_func, inode_less_func, NULL);
+  lock_init (&open_inodes_lock);
+}
+
+/* Returns the open inode at SECTOR, or a null pointer if it is
+   not open. Must be called with open_inodes_lock held. */
+static struct inode *
+inode_lookup (block_sector_t sector)
+{
+  // hash lookup : a temporary key
+  struct inode_key key;
+  key.sector = sector;
+
+  struct hash_elem *h = hash_find (&open_inodes, &key.elem);
+  if (h == NULL)
+    return NULL;
+  return hash_entry (h, struct inode, key.elem);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device. The data is a hole, which reads as zeros: its sectors are
+   allocated as they are written. A small file keeps its data in the
+   inode sector itself, without any data sector.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
@@ -162,11 +386,9 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->is_dir = is_dir;
-      if (inode_allocate (disk_inode))
-        {
-          buffer_cache_write (sector, disk_inode);
-          success = true;
-        }
+      disk_inode->is_inline = (size_t) length <= INLINE_DATA_SIZE;
+      inode_write_meta (sector, disk_inode);
+      success = true;
       free (disk_inode);
     }
   return success;
@@ -178,20 +400,16 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          return inode;
-        }
-    }
+  lock_acquire (&open_inodes_lock);
+  inode = inode_lookup (sector);
+  if (inode != NULL)
+    inode->open_cnt++;
+  lock_release (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
@@ -199,13 +417,33 @@ inode_open (block_sector_t sector)
     return NULL;
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
-  inode->sector = sector;
+  inode->key.sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-
-  buffer_cache_read (inode->sector, &inode->data);
+  inode->read_ahead_pos = 0;
+  inode->read_ahead_window = 0;
+  inode->read_ahead_end = 0;
+  inode->alloc_hint = 0;
+  inode->map = NULL;
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->lock);
+  list_init (&inode->ranges);
+  condvar_init (&inode->range_unlocked);
+
+  /* Read it without holding the lock. If someone else has opened
+     the inode meanwhile, share theirs instead. */
+  buffer_cache_read (inode->key.sector, &inode->data);
+
+  lock_acquire (&open_inodes_lock);
+  struct hash_elem *old = hash_insert (&open_inodes, &inode->key.elem);
+  if (old != NULL)
+    {
+      free (inode);
+      inode = hash_entry (old, struct inode, key.elem);
+      inode->open_cnt++;
+    }
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -214,7 +452,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -222,7 +464,7 @@ inode_reopen (struct inode *inode)
 block_sector_t
 inode_get_inumber (const struct inode *inode)
 {
-  return inode->sector;
+  return inode->key.sector;
 }
 
 /* Closes INODE and writes it to disk.
@@ -236,18 +478,22 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
-    {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+  lock_acquire (&open_inodes_lock);
+  bool last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->key.elem);
+  lock_release (&open_inodes_lock);
 
+  if (last)
+    {
       /* Deallocate blocks if removed. */
       if (inode->removed)
         {
-          free_map_release (inode->sector, 1);
+          free_map_release (inode->key.sector, 1);
           inode_deallocate (inode);
         }
 
+      free (inode->map);
       free (inode);
     }
 }
@@ -263,16 +509,46 @@ inode_remove (struct inode *inode)
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   Reads run in parallel with each other, and with the writes to
+   the other parts of INODE. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  struct inode_range range;
 
+  inode_lock_range (inode, &range, offset, size, false);
+  rwlock_acquire_read (&inode->rwlock);
+
+  if (inode->data.is_inline) {
+    // a small file: straight out of the in-memory inode
+    off_t inode_left = inode_length (inode) - offset;
+    if (size > 0 && inode_left > 0) {
+      bytes_read = size < inode_left ? size : inode_left;
+      memcpy (buffer, inode->data.inline_data + offset, bytes_read);
+    }
+    size = 0;
+  }
+
+  off_t loaded = offset;   // bytes before this are in the cache already
   while (size > 0)
     {
+      /* Bring the following sectors in, a run of them at a time. */
+      if (offset >= loaded
+          && offset % BLOCK_SECTOR_SIZE + size > BLOCK_SECTOR_SIZE)
+        {
+          off_t end = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE)
+                      + INODE_LOAD_SECTORS * BLOCK_SECTOR_SIZE;
+          if (end > offset + size)
+            end = offset + size;
+          if (end > inode_length (inode))
+            end = inode_length (inode);
+          inode_load (inode, offset, end);
+          loaded = end;
+        }
+
       /* Disk sector to read, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
@@ -287,23 +563,15 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          buffer_cache_read (sector_idx, buffer + bytes_read);
-        }
+      if (sector_idx == 0)
+        /* A hole reads as zeros, without touching the disk. */
+        memset (buffer + bytes_read, 0, chunk_size);
       else
         {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          buffer_cache_read (sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          /* Copy straight out of the cached sector into caller's buffer. */
+          const uint8_t *cached = buffer_cache_get (sector_idx, BUFFER_CACHE_READ);
+          memcpy (buffer + bytes_read, cached + sector_ofs, chunk_size);
+          buffer_cache_put (sector_idx, BUFFER_CACHE_READ);
         }
 
       /* Advance. */
@@ -311,15 +579,171 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
+  if (bytes_read > 0 && !inode->data.is_inline)
+    inode_read_ahead (inode, offset - bytes_read, offset);
+
+  rwlock_release_read (&inode->rwlock);
+  inode_unlock_range (inode, &range);
   return bytes_read;
 }
 
+/* Brings the data sectors of INODE holding bytes [START, END) into
+   the buffer cache, reading each physically contiguous run of them
+   with a single multi-sector disk request. Holes are skipped.
+   Must be called with INODE's rwlock held. */
+static void
+inode_load (struct inode *inode, off_t start, off_t end)
+{
+  size_t i = start / BLOCK_SECTOR_SIZE;
+  size_t last = DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  block_sector_t run = 0;   // the run of sectors [run, run + run_cnt)
+  size_t run_cnt = 0;
+
+  for (; i < last; ++ i) {
+    block_sector_t sector = index_to_sector (inode, i);
+    if (run_cnt > 0 && sector == run + run_cnt) {
+      run_cnt ++;
+      continue;
+    }
+    if (run_cnt > 0)
+      buffer_cache_load (run, run_cnt);
+    run = sector;
+    run_cnt = (sector != 0 && sector != (block_sector_t) -1);
+  }
+  if (run_cnt > 0)
+    buffer_cache_load (run, run_cnt);
+}
+
+/* Tracks the sequential access pattern of INODE after reading
+   bytes [START, END), and queues the sectors following END for
+   read-ahead. The read-ahead window grows while the reads stay
+   sequential, and is reset by a non-sequential read.
+   Must be called with INODE's rwlock held. */
+static void
+inode_read_ahead (struct inode *inode, off_t start, off_t end)
+{
+  lock_acquire (&inode->lock);
+  if (start == inode->read_ahead_pos) {
+    // sequential: grow the window
+    if (inode->read_ahead_window == 0)
+      inode->read_ahead_window = READ_AHEAD_MIN_WINDOW;
+    else
+      inode->read_ahead_window = min (inode->read_ahead_window * 2,
+                                      READ_AHEAD_MAX_WINDOW);
+  }
+  else {
+    // random access: no read-ahead
+    inode->read_ahead_window = 0;
+    inode->read_ahead_end = 0;
+  }
+  inode->read_ahead_pos = end;
+
+  // sectors [next, last) should be in the cache ahead of the reader
+  size_t next = DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  size_t last = min (next + inode->read_ahead_window,
+                     bytes_to_sectors (inode_length (inode)));
+  size_t i = (inode->read_ahead_end > next ? inode->read_ahead_end : next);
+  if (last > inode->read_ahead_end)
+    inode->read_ahead_end = last;
+  lock_release (&inode->lock);
+
+  for (; i < last; ++ i) {
+    block_sector_t sector = index_to_sector (inode, i);
+    if (sector != 0)  // nothing to read in a hole
+      buffer_cache_read_ahead (sector);
+  }
+}
+
+/* Allocates the holes among data sectors [FIRST, LAST) of INODE,
+   at most INODE_FILL_SECTORS of them, contiguously after the sector
+   before FIRST if possible, or else where the last allocation for
+   INODE ended, and writes the inode back. If only some of them can
+   be allocated, those are zeroed, so that they still read as holes.
+   Must be called with INODE's rwlock held for writing. */
+static bool
+inode_fill_holes (struct inode *inode, size_t first, size_t last)
+{
+  ASSERT (rwlock_held_for_write (&inode->rwlock));
+  ASSERT (last - first <= INODE_FILL_SECTORS);
+
+  block_sector_t prev = first > 0 ? index_to_sector (inode, first - 1) : 0;
+  block_sector_t goal = prev != 0 ? prev + 1
+                        : inode->alloc_hint != 0 ? inode->alloc_hint
+                        : inode->key.sector + 1;
+
+  // the holes, one bit per sector
+  uint64_t holes = 0;
+  size_t i;
+  for (i = first; i < last; ++ i) {
+    block_sector_t sector = index_to_sector (inode, i);
+    if (sector == 0 || sector == (block_sector_t) -1)
+      holes |= (uint64_t) 1 << (i - first);
+  }
+
+  inode_block_map_invalidate (inode);
+  bool success = inode_reserve (&inode->data, first, last, goal);
+  inode_write_meta (inode->key.sector, & inode->data);
+
+  // the caller writes none of them: the ones allocated would hold
+  // whatever was on the disk.
+  if (!success)
+    for (i = first; i < last; ++ i) {
+      block_sector_t sector = index_to_sector (inode, i);
+      if ((holes & ((uint64_t) 1 << (i - first))) == 0
+          || sector == 0 || sector == (block_sector_t) -1)
+        continue;
+      enum buffer_cache_mode mode =
+        inode_access_mode (inode, sector, BUFFER_CACHE_OVERWRITE);
+      uint8_t *cached = buffer_cache_get (sector, mode);
+      memset (cached, 0, BLOCK_SECTOR_SIZE);
+      buffer_cache_put (sector, mode);
+    }
+
+  block_sector_t tail = index_to_sector (inode, last - 1);
+  if (tail != 0 && tail != (block_sector_t) -1)
+    inode->alloc_hint = tail + 1;
+  return success;
+}
+
+/* Moves the inline data of INODE out into a data sector, so that it
+   can grow beyond INLINE_DATA_SIZE bytes. Must be called with INODE's
+   rwlock held for writing. */
+static bool
+inode_uninline (struct inode *inode)
+{
+  struct inode_disk *idisk = &inode->data;
+  block_sector_t sector = 0;   // a hole, if the file is empty
+
+  ASSERT (rwlock_held_for_write (&inode->rwlock));
+  ASSERT (idisk->is_inline);
+
+  if (idisk->length > 0) {
+    if (free_map_allocate_extent (1, inode->key.sector + 1, &sector) == 0)
+      return false;
+    inode->alloc_hint = sector + 1;
+    enum buffer_cache_mode mode =
+      inode_access_mode (inode, sector, BUFFER_CACHE_OVERWRITE);
+    uint8_t *cached = buffer_cache_get (sector, mode);
+    memset (cached, 0, BLOCK_SECTOR_SIZE);
+    memcpy (cached, idisk->inline_data, idisk->length);
+    buffer_cache_put (sector, mode);
+  }
+
+  memset (idisk->inline_data, 0, sizeof idisk->inline_data);
+  idisk->direct_blocks[0] = sector;
+  idisk->is_inline = false;
+  inode_write_meta (inode->key.sector, idisk);
+  return true;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
    (Normally a write at end of file would extend the inode).
+   Writes run in parallel with the reads and writes of the other
+   parts of INODE; the file is extended only after the data is
+   written, so that readers never see the extended part unwritten.
    */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
@@ -327,75 +751,149 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t end = offset + size;
+  size_t end_index = bytes_to_sectors (end);
+  bool last_was_hole = false; // the last sector written, if partially
+                              // written, was a hole
+  struct inode_range range;
 
   if (inode->deny_write_cnt)
     return 0;
 
-  // beyond the EOF: extend the file
-  if( byte_to_sector(inode, offset + size - 1) == -1u ) {
-    // extend and reserve up to [offset + size] bytes
-    bool success;
-    success = inode_reserve (& inode->data, offset + size);
-    if (!success) return 0;  // fail?
+  journal_begin ();
+  inode_lock_range (inode, &range, offset, size, true);
+
+  // a small file: write into the inode, unless it outgrows it.
+  // (a file never goes back inline, so checking it unlocked is safe)
+  if (size > 0 && inode->data.is_inline) {
+    bool done = false;
+    rwlock_acquire_write (&inode->rwlock);
+    if (inode->data.is_inline) {
+      if ((size_t) end <= INLINE_DATA_SIZE) {
+        memcpy (inode->data.inline_data + offset, buffer, size);
+        if (end > inode->data.length)
+          inode->data.length = end;
+        inode_write_meta (inode->key.sector, & inode->data);
+        bytes_written = size;
+        done = true;
+      }
+      else if (!inode_uninline (inode))
+        done = true;
+    }
+    rwlock_release_write (&inode->rwlock);
 
-    // write back the (extended) file size
-    inode->data.length = offset + size;
-    buffer_cache_write (inode->sector, & inode->data);
+    if (done) {
+      inode_unlock_range (inode, &range);
+      journal_end ();
+      return bytes_written;
+    }
   }
 
   while (size > 0)
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* Sector to write, starting byte offset within sector.
+         Beyond the EOF, it is a hole (or not in the file yet). */
+      size_t index = offset / BLOCK_SECTOR_SIZE;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      rwlock_acquire_read (&inode->rwlock);
+      block_sector_t sector_idx = index_to_sector (inode, index);
+      rwlock_release_read (&inode->rwlock);
 
       /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
-
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          buffer_cache_write (sector_idx, buffer + bytes_written);
-        }
-      else
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left)
-            buffer_cache_read (sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          buffer_cache_write (sector_idx, bounce);
-        }
+      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int chunk_size = size < sector_left ? size : sector_left;
+
+      /* A hole: allocate it, with the holes following it up to the
+         end of the write, INODE_FILL_SECTORS at a time. A newly
+         allocated sector holds garbage, so a partially written one
+         has to be zeroed. */
+      bool fresh = false;
+      if (sector_idx == 0 || sector_idx == -1u) {
+        size_t fill_end = min (end_index, index + INODE_FILL_SECTORS);
+        rwlock_acquire_write (&inode->rwlock);
+        block_sector_t last = index_to_sector (inode, end_index - 1);
+        last_was_hole = end % BLOCK_SECTOR_SIZE != 0
+          && (last == 0 || last == -1u);
+        bool success = inode_fill_holes (inode, index, fill_end);
+        if (success)
+          sector_idx = index_to_sector (inode, index);
+        rwlock_release_write (&inode->rwlock);
+        if (!success)
+          break;
+        fresh = true;
+      }
+      else if (last_was_hole && index == end_index - 1)
+        fresh = true;
+
+      /* Patch the cached sector in place. The sector needs to be
+         read (on a cache miss) only if it is partially written. */
+      bool whole = (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE);
+      enum buffer_cache_mode mode = inode_access_mode (inode, sector_idx,
+        (whole || fresh) ? BUFFER_CACHE_OVERWRITE : BUFFER_CACHE_WRITE);
+      uint8_t *cached = buffer_cache_get (sector_idx, mode);
+      if (!whole && fresh)
+        memset (cached, 0, BLOCK_SECTOR_SIZE);
+      memcpy (cached + sector_ofs, buffer + bytes_written, chunk_size);
+      buffer_cache_put (sector_idx, mode);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
 
+  // beyond the EOF: extend the file up to the data written.
+  // the gap is left as a hole, which is allocated only when written.
+  if (offset > inode_length (inode)) {
+    rwlock_acquire_write (&inode->rwlock);
+    if (offset > inode->data.length) {
+      inode->data.length = offset;
+      inode_write_meta (inode->key.sector, & inode->data);
+    }
+    rwlock_release_write (&inode->rwlock);
+  }
+
+  inode_unlock_range (inode, &range);
+  journal_end ();
   return bytes_written;
 }
 
+/* Writes the data of INODE that is only in the buffer cache to
+   disk, and commits its metadata, so that it survives a crash.
+   Returns false on a write error. */
+bool
+inode_sync (struct inode *inode)
+{
+  // the data of a directory, or of an inline file, is metadata:
+  // the journal takes care of it. (an inline file is checked for with
+  // the rwlock held, as a write may move its data out into sectors.)
+  if (!inode_is_meta (inode)) {
+    block_sector_t *sectors = NULL;
+    size_t n = 0;
+
+    rwlock_acquire_read (&inode->rwlock);
+    if (!inode->data.is_inline) {
+      size_t cnt = bytes_to_sectors (inode->data.length), i;
+      sectors = malloc (cnt * sizeof *sectors);
+      if (sectors == NULL && cnt > 0) {
+        rwlock_release_read (&inode->rwlock);
+        return false;
+      }
+      for (i = 0; i < cnt; i++) {
+        block_sector_t sector = index_to_sector (inode, i);
+        if (sector != 0 && sector != (block_sector_t) -1)
+          sectors[n++] = sector;
+      }
+    }
+    rwlock_release_read (&inode->rwlock);
+
+    buffer_cache_sync_sectors (sectors, n);
+    free (sectors);
+  }
+  return journal_commit ();
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -437,95 +935,168 @@ inode_is_removed (const struct inode *inode)
   return inode->removed;
 }
 
-static
-bool inode_allocate (struct inode_disk *disk_inode)
-{
-  return inode_reserve (disk_inode, disk_inode->length);
-}
+/* A run of contiguous sectors taken from the free map at once, and
+   handed out one by one to the blocks of a file by inode_reserve(). */
+struct inode_extent {
+  block_sector_t next;  // next sector to hand out, or where the next run
+                        // should start if the run is used up
+  size_t left;          // number of sectors left in the run
+  size_t wanted;        // number of sectors the file still needs
+};
 
+/* Takes a sector from EXT into *P_ENTRY, and fills it with zeros
+   if ZERO is true. A new run is allocated if EXT is used up. */
 static bool
-inode_reserve_indirect (block_sector_t* p_entry, size_t num_sectors, int level)
+inode_extent_take (struct inode_extent *ext, block_sector_t *p_entry,
+                   bool zero)
 {
   static char zeros[BLOCK_SECTOR_SIZE];
 
+  if (ext->left == 0) {
+    ext->left = free_map_allocate_extent (ext->wanted > 0 ? ext->wanted : 1,
+                                          ext->next, &ext->next);
+    if (ext->left == 0) return false;
+  }
+  *p_entry = ext->next ++;
+  ext->left --;
+  if (ext->wanted > 0) ext->wanted --;
+
+  if (zero)
+    inode_write_meta (*p_entry, zeros);
+  return true;
+}
+
+/* Returns the number of sectors, including the indirect blocks,
+   taken by a file of SECTORS data sectors. */
+static size_t
+inode_total_sectors (size_t sectors)
+{
+  size_t total = sectors;
+  if (sectors > DIRECT_BLOCKS_COUNT)
+    total += 1;
+  if (sectors > DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR)
+    total += 1 + DIV_ROUND_UP (sectors - DIRECT_BLOCKS_COUNT
+                               - INDIRECT_BLOCKS_PER_SECTOR,
+                               INDIRECT_BLOCKS_PER_SECTOR);
+  return total;
+}
+
+/**
+ * Allocates the holes among the data sectors [first, last) mapped by
+ * the (indirect) block at `*p_entry`, relative to the first one it maps.
+ */
+static bool
+inode_reserve_indirect (block_sector_t* p_entry, size_t first, size_t last,
+                        int level, struct inode_extent *ext)
+{
   // only supports 2-level indirect block scheme as of now
   ASSERT (level <= 2);
 
   if (level == 0) {
     // base case : allocate a single sector if necessary and put it into the block
-    if (*p_entry == 0) {
-      if(! free_map_allocate (1, p_entry))
-        return false;
-      buffer_cache_write (*p_entry, zeros);
-    }
+    if (*p_entry == 0)
+      return inode_extent_take (ext, p_entry, false);
     return true;
   }
 
-  struct inode_indirect_block_sector indirect_block;
+  struct inode_indirect_block_sector *indirect_block;
   if(*p_entry == 0) {
-    // not yet allocated: allocate it, and fill with zero
-    free_map_allocate (1, p_entry);
-    buffer_cache_write (*p_entry, zeros);
+    // not yet allocated: allocate it, and fill with zero (all holes)
+    if(! inode_extent_take (ext, p_entry, true))
+      return false;
   }
-  buffer_cache_read(*p_entry, &indirect_block);
+  indirect_block = buffer_cache_get (*p_entry, BUFFER_CACHE_READ);
 
   size_t unit = (level == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR);
-  size_t i, l = DIV_ROUND_UP (num_sectors, unit);
+  size_t i;
+  bool success = true;
+
+  // modified (and written back) only if some entry is to be
+  // allocated: the block joins the running transaction before that.
+  enum buffer_cache_mode mode = BUFFER_CACHE_READ;
+  for (i = first / unit; i * unit < last; ++ i)
+    if (indirect_block->blocks[i] == 0) {
+      mode = journal_access (*p_entry, BUFFER_CACHE_WRITE);
+      buffer_cache_get (*p_entry, mode);
+      buffer_cache_put (*p_entry, BUFFER_CACHE_READ);
+      break;
+    }
 
-  for (i = 0; i < l; ++ i) {
-    size_t subsize = min(num_sectors, unit);
-    if(! inode_reserve_indirect (& indirect_block.blocks[i], subsize, level - 1))
-      return false;
-    num_sectors -= subsize;
+  for (i = first / unit; i * unit < last; ++ i) {
+    // the part of [first, last) mapped by the i-th entry
+    size_t sub_first = first > i * unit ? first - i * unit : 0;
+    size_t sub_last = min (last - i * unit, unit);
+
+    success = inode_reserve_indirect (& indirect_block->blocks[i],
+                                      sub_first, sub_last, level - 1, ext);
+    if (!success) break;
   }
 
-  ASSERT (num_sectors == 0);
-  buffer_cache_write (*p_entry, &indirect_block);
-  return true;
+  buffer_cache_put (*p_entry, mode);
+  return success;
 }
 
 /**
- * Extend inode blocks, so that the file can hold at least
- * `length` bytes.
+ * Allocates the holes among the data sectors [first, last) of the
+ * inode, along with the indirect blocks that map them. New sectors are
+ * allocated in contiguous runs, starting from `goal` if it is free.
+ * The data sectors are not initialized.
  */
 static bool
-inode_reserve (struct inode_disk *disk_inode, off_t length)
+inode_reserve (struct inode_disk *disk_inode, size_t first, size_t last,
+               block_sector_t goal)
 {
-  static char zeros[BLOCK_SECTOR_SIZE];
-  if (length < 0) return false;
+  size_t index_base = 0, index_limit = 0;   // base, limit for sector index
+  size_t i;
 
-  // (remaining) number of sectors, occupied by this file.
-  size_t num_sectors = bytes_to_sectors(length);
-  size_t i, l;
+  if (first >= last) return true;
+  if (last > DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR
+             + INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR)
+    return false;   // too large
+
+  // all of the new sectors are asked for at once, in a single run.
+  // (an upper bound: some of them may be allocated already)
+  struct inode_extent ext;
+  ext.next = goal;
+  ext.left = 0;
+  ext.wanted = inode_total_sectors (last) - inode_total_sectors (first);
+
+  bool success = false;
 
   // (1) direct blocks
-  l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
-  for (i = 0; i < l; ++ i) {
+  index_limit += DIRECT_BLOCKS_COUNT * 1;
+  for (i = first; i < min (last, index_limit); ++ i) {
     if (disk_inode->direct_blocks[i] == 0) { // unoccupied
-      if(! free_map_allocate (1, &disk_inode->direct_blocks[i]))
-        return false;
-      buffer_cache_write (disk_inode->direct_blocks[i], zeros);
+      if(! inode_extent_take (&ext, &disk_inode->direct_blocks[i], false))
+        goto done;
     }
   }
-  num_sectors -= l;
-  if(num_sectors == 0) return true;
+  index_base = index_limit;
 
   // (2) a single indirect block
-  l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
-  if(! inode_reserve_indirect (& disk_inode->indirect_block, l, 1))
-    return false;
-  num_sectors -= l;
-  if(num_sectors == 0) return true;
+  index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR;
+  if (first < index_limit && last > index_base) {
+    if(! inode_reserve_indirect (& disk_inode->indirect_block,
+                                 first > index_base ? first - index_base : 0,
+                                 min (last, index_limit) - index_base, 1, &ext))
+      goto done;
+  }
+  index_base = index_limit;
 
   // (3) a single doubly indirect block
-  l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-  if(! inode_reserve_indirect (& disk_inode->doubly_indirect_block, l, 2))
-    return false;
-  num_sectors -= l;
-  if(num_sectors == 0) return true;
+  if (last > index_base) {
+    if(! inode_reserve_indirect (& disk_inode->doubly_indirect_block,
+                                 first > index_base ? first - index_base : 0,
+                                 last - index_base, 2, &ext))
+      goto done;
+  }
+  success = true;
 
-  ASSERT (num_sectors == 0);
-  return false;
+done:
+  // give back what is left of the last run
+  if (ext.left > 0)
+    free_map_release (ext.next, ext.left);
+  return success;
 }
 
 static void
@@ -534,24 +1105,27 @@ inode_deallocate_indirect (block_sector_t entry, size_t num_sectors, int level)
   // only supports 2-level indirect block scheme as of now
   ASSERT (level <= 2);
 
+  if (entry == 0) return;  // a hole
+
   if (level == 0) {
     free_map_release (entry, 1);
     return;
   }
 
-  struct inode_indirect_block_sector indirect_block;
-  buffer_cache_read(entry, &indirect_block);
+  struct inode_indirect_block_sector *indirect_block;
+  indirect_block = buffer_cache_get (entry, BUFFER_CACHE_READ);
 
   size_t unit = (level == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR);
   size_t i, l = DIV_ROUND_UP (num_sectors, unit);
 
   for (i = 0; i < l; ++ i) {
     size_t subsize = min(num_sectors, unit);
-    inode_deallocate_indirect (indirect_block.blocks[i], subsize, level - 1);
+    inode_deallocate_indirect (indirect_block->blocks[i], subsize, level - 1);
     num_sectors -= subsize;
   }
 
   ASSERT (num_sectors == 0);
+  buffer_cache_put (entry, BUFFER_CACHE_READ);
   free_map_release (entry, 1);
 }
 
@@ -560,6 +1134,7 @@ bool inode_deallocate (struct inode *inode)
 {
   off_t file_length = inode->data.length; // bytes
   if(file_length < 0) return false;
+  if(inode->data.is_inline) return true;  // no data sectors
 
   // (remaining) number of sectors, occupied by this file.
   size_t num_sectors = bytes_to_sectors(file_length);
@@ -568,7 +1143,8 @@ bool inode_deallocate (struct inode *inode)
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
   for (i = 0; i < l; ++ i) {
-    free_map_release (inode->data.direct_blocks[i], 1);
+    if (inode->data.direct_blocks[i] != 0)
+      free_map_release (inode->data.direct_blocks[i], 1);
   }
   num_sectors -= l;
 
@@ -590,3 +1166,51 @@ bool inode_deallocate (struct inode *inode)
   return true;
 }
 
+
+/* Helpers */
+
+// Whether the data of INODE is metadata, updated through the journal:
+// that of the directories, and of the free map file.
+static bool
+inode_is_meta (const struct inode *inode)
+{
+  return inode->data.is_dir || inode->key.sector == FREE_MAP_SECTOR;
+}
+
+// Returns the mode to modify SECTOR of INODE in, given as MODE: its
+// sectors join the running transaction if they are metadata.
+static enum buffer_cache_mode
+inode_access_mode (const struct inode *inode, block_sector_t sector,
+                   enum buffer_cache_mode mode)
+{
+  return inode_is_meta (inode) ? journal_access (sector, mode) : mode;
+}
+
+// Writes the metadata SECTOR (an inode, or an indirect block) from
+// SOURCE into the buffer cache, as part of the running transaction.
+static void
+inode_write_meta (block_sector_t sector, const void *source)
+{
+  enum buffer_cache_mode mode =
+    journal_access (sector, BUFFER_CACHE_OVERWRITE);
+  void *cached = buffer_cache_get (sector, mode);
+  memcpy (cached, source, BLOCK_SECTOR_SIZE);
+  buffer_cache_put (sector, mode);
+}
+
+// Hash Functions required for [open_inodes]. Uses 'sector' as key.
+static unsigned
+inode_hash_func (const struct hash_elem *elem, void *aux UNUSED)
+{
+  struct inode_key *key = hash_entry (elem, struct inode_key, elem);
+  return hash_int ((int) key->sector);
+}
+
+static bool
+inode_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  struct inode_key *a_key = hash_entry (a, struct inode_key, elem);
+  struct inode_key *b_key = hash_entry (b, struct inode_key, elem);
+  return a_key->sector < b_key->sector;
+}
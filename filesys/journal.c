@@ -0,0 +1,475 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/condvar.h"
+#include "threads/lock.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* A write-ahead journal of the metadata: the inodes, the indirect
+   blocks, the directories, and the free map.
+
+   Metadata updates are made in the buffer cache as usual, within
+   operations (journal_begin() ... journal_end()) which are grouped
+   into a transaction. The sectors updated by the running transaction
+   are held in the cache from before they are changed (see
+   journal_access()), not written back. Every second, or once it
+   grows large, the transaction is committed: the operations in
+   progress are let complete, new ones wait, and the sectors are
+   written into the journal, followed by a commit block. From then on,
+   they are written back in place as any other sector.
+
+   The journal area is used from the start on. Once it has no room
+   left for another transaction, every dirty sector is written back,
+   and it is emptied (a checkpoint). The sectors released by the file
+   system only become available again then, see free_map_release().
+   On mount, the transactions committed in the journal since the last
+   checkpoint are written again in place (replayed).
+
+   On disk, the header at JOURNAL_SECTOR tells where the area is and
+   the sequence number of the first transaction in it. A transaction
+   is a descriptor block listing the sectors, their contents, and a
+   commit block, with a checksum of the contents. */
+
+/* Identify the journal header, descriptor, and commit blocks. */
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_DESC_MAGIC 0x4a444553
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54
+
+/* Size of the journal area: 1/JOURNAL_FRACTION of the device, within
+   [JOURNAL_MIN_SIZE, JOURNAL_MAX_SIZE] sectors. */
+#define JOURNAL_FRACTION 32
+#define JOURNAL_MIN_SIZE 64
+#define JOURNAL_MAX_SIZE 1024
+
+/* The running transaction is committed every JOURNAL_COMMIT_INTERVAL
+   milliseconds. */
+#define JOURNAL_COMMIT_INTERVAL 1000
+
+/* Maximum number of sectors of a transaction: those listed in a
+   single descriptor block. */
+#define JOURNAL_DESC_SECTORS ((BLOCK_SECTOR_SIZE - 12) / sizeof (block_sector_t))
+
+/* Journal header, at JOURNAL_SECTOR. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    block_sector_t start;               /* First sector of the area. */
+    uint32_t size;                      /* Number of sectors of the area. */
+    uint32_t seq;                       /* Sequence number of the first
+                                           transaction in the area. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 16];
+  };
+
+/* Descriptor block, the first one of a transaction. */
+struct journal_desc
+  {
+    uint32_t magic;                     /* JOURNAL_DESC_MAGIC. */
+    uint32_t seq;                       /* Sequence number. */
+    uint32_t cnt;                       /* Number of sectors. */
+    block_sector_t sectors[JOURNAL_DESC_SECTORS];  /* Where they belong. */
+  };
+
+/* Commit block, following the contents of the sectors. */
+struct journal_commit
+  {
+    uint32_t magic;                     /* JOURNAL_COMMIT_MAGIC. */
+    uint32_t seq;                       /* Sequence number. */
+    uint32_t checksum;                  /* Of the contents. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 12];
+  };
+
+static bool enabled;                    /* Between open and close. */
+static struct journal_header header;    /* In-memory copy of the header. */
+static uint32_t used;                   /* Sectors of the area in use. */
+static uint32_t next_seq;               /* Of the running transaction. */
+
+/* The running transaction: the sectors held in the cache. */
+static block_sector_t tx_sectors[JOURNAL_DESC_SECTORS];
+static size_t tx_cnt;
+static size_t tx_limit;                 /* Maximum number of sectors. */
+static bool tx_overflow;                /* Too large for the journal? */
+
+static int op_cnt;                      /* Operations in progress. */
+static bool committing;                 /* A commit is in progress. */
+static bool commit_success;             /* Result of the last commit. */
+static struct lock journal_lock;        /* Protects all of the above. */
+static struct condvar journal_cond;     /* Broadcast when op_cnt drops
+                                           to 0, or a commit ends. */
+
+static thread_func journal_commit_worker NO_RETURN;
+
+static void journal_replay (void);
+static bool journal_write (void);
+static void journal_checkpoint (void);
+static uint32_t journal_checksum (uint32_t, const void *);
+
+/* Initializes the journal module.  Operations may begin from then
+   on, before the journal is opened: they are not journaled then. */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  condvar_init (&journal_cond);
+}
+
+/* Creates the journal, when formatting the file system. */
+void
+journal_create (void)
+{
+  uint32_t size = block_size (fs_device) / JOURNAL_FRACTION;
+  if (size < JOURNAL_MIN_SIZE)
+    size = JOURNAL_MIN_SIZE;
+  if (size > JOURNAL_MAX_SIZE)
+    size = JOURNAL_MAX_SIZE;
+
+  // the sequence numbers go on from the journal of a former file
+  // system, if any, so that none of its transactions is replayed.
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  uint32_t seq = header.magic == JOURNAL_MAGIC ? header.seq + 0x10000 : 1;
+
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.seq = seq;
+  header.size = size;
+  if (free_map_allocate_extent (size, JOURNAL_SECTOR + 1, &header.start)
+      != size)
+    PANIC ("journal creation failed");
+
+  // an empty journal, starting with an invalid descriptor.
+  static struct journal_desc zeros;
+  block_write (fs_device, header.start, &zeros);
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Opens the journal, when mounting the file system, replaying the
+   transactions committed in it. */
+void
+journal_open (void)
+{
+  static bool worker_started;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    PANIC ("no journal found: the file system needs to be formatted");
+  journal_replay ();
+
+  used = 0;
+  next_seq = header.seq;
+  tx_cnt = 0;
+  tx_overflow = false;
+  op_cnt = 0;
+  committing = false;
+  commit_success = true;
+
+  // a transaction (with its descriptor and commit block) fits into
+  // half of the journal, and never holds more than a quarter of the
+  // buffer cache.
+  tx_limit = JOURNAL_DESC_SECTORS;
+  if (tx_limit > header.size / 2 - 2)
+    tx_limit = header.size / 2 - 2;
+  if (tx_limit > buffer_cache_sectors () / 4)
+    tx_limit = buffer_cache_sectors () / 4;
+  enabled = true;
+
+  if (!worker_started) {
+    worker_started = true;
+    thread_create ("journal", PRI_DEFAULT, journal_commit_worker, NULL);
+  }
+}
+
+/* Commits the running transaction and empties the journal, when
+   unmounting the file system. */
+void
+journal_close (void)
+{
+  if (!journal_commit ())
+    PANIC ("can't write journal");
+
+  lock_acquire (&journal_lock);
+  journal_checkpoint ();
+  free_map_reclaim ();
+  enabled = false;
+  lock_release (&journal_lock);
+}
+
+bool
+journal_enabled (void)
+{
+  return enabled;
+}
+
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+  if (t->journal_depth ++ > 0)
+    return;   // nested: part of the outer operation
+
+  lock_acquire (&journal_lock);
+  // a large transaction is committed before others join it.
+  // (the operations in progress may still add to it)
+  if (enabled && tx_cnt >= tx_limit / 2 && !committing) {
+    lock_release (&journal_lock);
+    t->journal_depth --;
+    journal_commit ();
+    t->journal_depth ++;
+    lock_acquire (&journal_lock);
+  }
+  while (committing)
+    condvar_wait (&journal_cond, &journal_lock);
+  op_cnt ++;
+  lock_release (&journal_lock);
+}
+
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+  ASSERT (t->journal_depth > 0);
+  if (-- t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  if (-- op_cnt == 0)
+    condvar_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+enum buffer_cache_mode
+journal_access (block_sector_t sector, enum buffer_cache_mode mode)
+{
+  ASSERT (mode == BUFFER_CACHE_WRITE || mode == BUFFER_CACHE_OVERWRITE);
+
+  // not journaled: while formatting, or outside of any operation
+  if (!enabled || thread_current ()->journal_depth == 0)
+    return mode;
+
+  lock_acquire (&journal_lock);
+  size_t i;
+  for (i = 0; i < tx_cnt; i++)
+    if (tx_sectors[i] == sector)
+      break;
+  if (i == tx_cnt && !tx_overflow) {
+    if (tx_cnt < tx_limit)
+      tx_sectors[tx_cnt ++] = sector;
+    else {
+      // an operation too large for the journal: the sectors it
+      // updates from now on are written back without it. (the whole
+      // transaction is written in place at commit)
+      tx_overflow = true;
+    }
+  }
+  bool held = i < tx_cnt;
+  lock_release (&journal_lock);
+
+  // the caller gets the sector next, which holds it in the cache
+  // before any change. (no commit takes place meanwhile, the
+  // operation being in progress)
+  if (!held)
+    return mode;
+  return (mode == BUFFER_CACHE_WRITE
+          ? BUFFER_CACHE_META_WRITE : BUFFER_CACHE_META_OVERWRITE);
+}
+
+bool
+journal_commit (void)
+{
+  struct thread *t = thread_current ();
+  bool success = true;
+
+  ASSERT (t->journal_depth == 0);
+
+  lock_acquire (&journal_lock);
+  if (!enabled) {
+    lock_release (&journal_lock);
+    return true;
+  }
+  // group commit: the commit in progress, if any, waits for every
+  // operation begun before it, which includes those of the caller.
+  if (committing) {
+    while (committing)
+      condvar_wait (&journal_cond, &journal_lock);
+    success = commit_success;
+    lock_release (&journal_lock);
+    return success;
+  }
+
+  // wait for the operations in progress to complete. new ones wait
+  // for the commit.
+  committing = true;
+  while (op_cnt > 0)
+    condvar_wait (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+
+  // the changes of the free map join the transaction, as a part of
+  // it rather than as an operation, which would wait for the commit.
+  t->journal_depth ++;
+  if (!free_map_flush ())
+    success = false;
+  t->journal_depth --;
+
+  lock_acquire (&journal_lock);
+  if (tx_cnt > 0 && !tx_overflow && !journal_write ())
+    success = false;
+
+  size_t i;
+  for (i = 0; i < tx_cnt; i++)
+    buffer_cache_release (tx_sectors[i]);
+  tx_cnt = 0;
+
+  // make room for the next transaction. the sectors released meanwhile
+  // become available only then, unless the disk ran out of them: a
+  // checkpoint writes back every dirty sector, with no operation let
+  // in, which is too costly to do for every file removed.
+  if (tx_overflow || used + tx_limit + 2 > header.size
+      || free_map_needs_reclaim ()) {
+    journal_checkpoint ();
+    free_map_reclaim ();
+  }
+  tx_overflow = false;
+
+  commit_success = success;
+  committing = false;
+  condvar_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+  return success;
+}
+
+/* Writes the running transaction into the journal, as the sectors
+   it holds in the cache. Must be called with journal_lock held. */
+static bool
+journal_write (void)
+{
+  struct journal_desc *desc = malloc (sizeof *desc);
+  struct journal_commit *commit = malloc (sizeof *commit);
+  void **buffers = malloc ((tx_cnt + 1) * sizeof *buffers);
+  size_t i;
+
+  ASSERT (used + tx_cnt + 2 <= header.size);
+  if (desc == NULL || commit == NULL || buffers == NULL) {
+    free (desc);
+    free (commit);
+    free (buffers);
+    return false;
+  }
+
+  memset (desc, 0, sizeof *desc);
+  desc->magic = JOURNAL_DESC_MAGIC;
+  desc->seq = next_seq;
+  desc->cnt = tx_cnt;
+  memset (commit, 0, sizeof *commit);
+  commit->magic = JOURNAL_COMMIT_MAGIC;
+  commit->seq = next_seq;
+
+  // the descriptor and the contents with a single request, straight
+  // out of the cache, and then the commit block.
+  buffers[0] = desc;
+  for (i = 0; i < tx_cnt; i++) {
+    desc->sectors[i] = tx_sectors[i];
+    buffers[i + 1] = buffer_cache_get (tx_sectors[i], BUFFER_CACHE_READ);
+    commit->checksum = journal_checksum (commit->checksum, buffers[i + 1]);
+  }
+  block_write_multiple (fs_device, header.start + used, buffers, tx_cnt + 1);
+  block_write (fs_device, header.start + used + tx_cnt + 1, commit);
+  for (i = 0; i < tx_cnt; i++)
+    buffer_cache_put (tx_sectors[i], BUFFER_CACHE_READ);
+
+  used += tx_cnt + 2;
+  next_seq ++;
+  free (desc);
+  free (commit);
+  free (buffers);
+  return true;
+}
+
+/* Writes every dirty sector back in place, and empties the journal.
+   Must be called with journal_lock held, with no sector held. */
+static void
+journal_checkpoint (void)
+{
+  ASSERT (tx_cnt == 0);
+
+  buffer_cache_sync ();
+  if (used == 0 && header.seq == next_seq)
+    return;
+  header.seq = next_seq;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+  used = 0;
+}
+
+/* Writes the transactions committed in the journal in place, and
+   empties it. */
+static void
+journal_replay (void)
+{
+  struct journal_desc *desc = malloc (sizeof *desc);
+  struct journal_commit *commit = malloc (sizeof *commit);
+  uint8_t *buffer = malloc (BLOCK_SECTOR_SIZE);
+  uint32_t pos = 0, cnt = 0;
+  size_t i;
+
+  if (desc == NULL || commit == NULL || buffer == NULL)
+    PANIC ("journal replay failed: out of memory");
+
+  while (pos + 2 <= header.size) {
+    block_read (fs_device, header.start + pos, desc);
+    if (desc->magic != JOURNAL_DESC_MAGIC || desc->seq != header.seq + cnt
+        || desc->cnt > JOURNAL_DESC_SECTORS
+        || pos + desc->cnt + 2 > header.size)
+      break;
+
+    // complete, if the commit block is there and matches the contents
+    uint32_t checksum = 0;
+    for (i = 0; i < desc->cnt; i++) {
+      block_read (fs_device, header.start + pos + 1 + i, buffer);
+      checksum = journal_checksum (checksum, buffer);
+    }
+    block_read (fs_device, header.start + pos + 1 + desc->cnt, commit);
+    if (commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != desc->seq
+        || commit->checksum != checksum)
+      break;
+
+    for (i = 0; i < desc->cnt; i++) {
+      block_read (fs_device, header.start + pos + 1 + i, buffer);
+      block_write (fs_device, desc->sectors[i], buffer);
+    }
+    pos += desc->cnt + 2;
+    cnt ++;
+  }
+
+  if (cnt > 0) {
+    printf ("Journal: replayed %"PRIu32" transactions.\n", cnt);
+    header.seq += cnt;
+    block_write (fs_device, JOURNAL_SECTOR, &header);
+  }
+  free (desc);
+  free (commit);
+  free (buffer);
+}
+
+/* Returns CHECKSUM updated with the sector at DATA. */
+static uint32_t
+journal_checksum (uint32_t checksum, const void *data)
+{
+  return checksum * 16777619 ^ hash_bytes (data, BLOCK_SECTOR_SIZE);
+}
+
+/* The journal thread: commits the running transaction periodically,
+   for the metadata updates to reach the disk. */
+static void
+journal_commit_worker (void *aux UNUSED)
+{
+  while (true) {
+    timer_msleep (JOURNAL_COMMIT_INTERVAL);
+    journal_commit ();
+  }
+}
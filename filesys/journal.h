@@ -0,0 +1,49 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/cache.h"
+
+/* Metadata Journal. */
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+
+/**
+ * Returns whether metadata updates are journaled, which is the case
+ * between journal_open() and journal_close().
+ */
+bool journal_enabled (void);
+
+/**
+ * Begins and ends an operation that updates metadata, all of whose
+ * updates are committed within the same transaction. Operations
+ * nest: only the outermost one counts.
+ */
+void journal_begin (void);
+void journal_end (void);
+
+/**
+ * Adds the metadata SECTOR, about to be modified in MODE
+ * (BUFFER_CACHE_WRITE or BUFFER_CACHE_OVERWRITE) within an operation,
+ * to the running transaction. Returns the mode to get and put the
+ * sector in: one of the BUFFER_CACHE_META modes, which hold it in
+ * the cache until the commit, or MODE itself if the sector is not
+ * journaled. Must be called before the sector is modified.
+ */
+enum buffer_cache_mode journal_access (block_sector_t sector,
+                                       enum buffer_cache_mode mode);
+
+/**
+ * Commits the running transaction, along with the changes of the
+ * free map: they are durable once this returns. A caller that comes
+ * while a commit is in progress shares it, since the commit includes
+ * every operation ended so far. Must not be called within an
+ * operation. Returns false on a write error.
+ */
+bool journal_commit (void);
+
+#endif /* filesys/journal.h */
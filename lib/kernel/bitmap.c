@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -23,11 +24,22 @@ typedef unsigned long elem_type;
 
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   A summary level, with a bit per element of BITS, tells the
+   elements whose bits are all true (FULL) and all false (EMPTY),
+   so that a scan skips them without looking at them: up to
+   ELEM_BITS * ELEM_BITS bits at a time.  Each bit is still set
+   atomically, and each change brings the summary of its element
+   up to date with interrupts off, so the summary stays exact even
+   if changes to a bitmap are not serialized: palloc_free_multiple(),
+   for one, frees pages without the pool's lock. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    elem_type *full;    /* Summary: elements with all bits true. */
+    elem_type *empty;   /* Summary: elements with all bits false. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -60,6 +72,22 @@ byte_cnt (size_t bit_cnt)
   return sizeof (elem_type) * elem_cnt (bit_cnt);
 }
 
+/* Returns the number of elements in each summary of a bitmap
+   with BIT_CNT bits. */
+static inline size_t
+summary_cnt (size_t bit_cnt)
+{
+  return elem_cnt (elem_cnt (bit_cnt));
+}
+
+/* Returns the number of bytes required for BIT_CNT bits and
+   their summaries. */
+static inline size_t
+storage_byte_cnt (size_t bit_cnt)
+{
+  return byte_cnt (bit_cnt) + 2 * sizeof (elem_type) * summary_cnt (bit_cnt);
+}
+
 /* Returns a bit mask in which the bits actually used in the last
    element of B's bits are set to 1 and the rest are set to 0. */
 static inline elem_type
@@ -68,6 +96,84 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns a bit mask with the low CNT bits set to 1, for CNT up
+   to ELEM_BITS. */
+static inline elem_type
+low_mask (size_t cnt)
+{
+  return cnt < ELEM_BITS ? ((elem_type) 1 << cnt) - 1 : (elem_type) -1;
+}
+
+/* Returns a bit mask of the bits of element IDX that fall within
+   bits START through START + CNT - 1 of a bitmap. */
+static inline elem_type
+range_mask (size_t idx, size_t start, size_t cnt)
+{
+  size_t first = idx * ELEM_BITS;
+  size_t lo = start > first ? start - first : 0;
+  size_t hi = start + cnt - first < ELEM_BITS ? start + cnt - first : ELEM_BITS;
+  return low_mask (hi) & ~low_mask (lo);
+}
+
+/* Returns the index of the lowest set bit in X, which must not
+   be 0. */
+static inline size_t
+lowest_bit (elem_type x)
+{
+  ASSERT (x != 0);
+  return __builtin_ctzl (x);
+}
+
+/* Returns the number of set bits in X. */
+static inline size_t
+popcount (elem_type x)
+{
+  size_t cnt = 0;
+  for (; x != 0; x &= x - 1)
+    cnt++;
+  return cnt;
+}
+
+/* Sets bit IDX of SUMMARY to VALUE. */
+static inline void
+summary_set (elem_type *summary, size_t idx, bool value)
+{
+  if (value)
+    summary[elem_idx (idx)] |= bit_mask (idx);
+  else
+    summary[elem_idx (idx)] &= ~bit_mask (idx);
+}
+
+/* Brings the summary bits of element IDX of B up to date.  This
+   reads the element and then writes two summary words, with
+   interrupts off: otherwise a change of the element made meanwhile
+   by another thread could be overwritten by a stale summary. */
+static inline void
+summary_update (struct bitmap *b, size_t idx)
+{
+  elem_type mask = idx == elem_cnt (b->bit_cnt) - 1 ? last_mask (b)
+                                                    : (elem_type) -1;
+  enum intr_level old_level = intr_disable ();
+  elem_type word = b->bits[idx] & mask;
+  summary_set (b->full, idx, word == mask);
+  summary_set (b->empty, idx, word == 0);
+  intr_set_level (old_level);
+}
+
+/* Points B's summaries into the storage following its bits, and
+   clears them. */
+static void
+summary_init (struct bitmap *b)
+{
+  size_t cnt = summary_cnt (b->bit_cnt);
+  size_t i;
+
+  b->full = b->bits + elem_cnt (b->bit_cnt);
+  b->empty = b->full + cnt;
+  for (i = 0; i < cnt; i++)
+    b->full[i] = b->empty[i] = 0;
+}
 
 /* Creation and destruction. */
 
@@ -82,9 +188,10 @@ bitmap_create (size_t bit_cnt)
   if (b != NULL)
     {
       b->bit_cnt = bit_cnt;
-      b->bits = malloc (byte_cnt (bit_cnt));
+      b->bits = malloc (storage_byte_cnt (bit_cnt));
       if (b->bits != NULL || bit_cnt == 0)
         {
+          summary_init (b);
           bitmap_set_all (b, false);
           return b;
         }
@@ -105,6 +212,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  summary_init (b);
   bitmap_set_all (b, false);
   return b;
 }
@@ -114,7 +222,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt) 
 {
-  return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+  return sizeof (struct bitmap) + storage_byte_cnt (bit_cnt);
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -163,6 +271,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  summary_update (b, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -176,6 +285,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  summary_update (b, idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -191,6 +301,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  summary_update (b, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -213,18 +324,28 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Works an element at a time; each element is set atomically. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  size_t idx;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  if (cnt == 0)
+    return;
+  for (idx = elem_idx (start); idx <= elem_idx (start + cnt - 1); idx++)
+    {
+      elem_type mask = range_mask (idx, start, cnt);
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+      summary_update (b, idx);
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -232,16 +353,20 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i, value_cnt;
+  size_t idx, value_cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
+  if (cnt == 0)
+    return 0;
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  for (idx = elem_idx (start); idx <= elem_idx (start + cnt - 1); idx++)
+    {
+      elem_type word = value ? b->bits[idx] : ~b->bits[idx];
+      value_cnt += popcount (word & range_mask (idx, start, cnt));
+    }
   return value_cnt;
 }
 
@@ -250,15 +375,20 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  size_t idx;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
+  if (cnt == 0)
+    return false;
+  for (idx = elem_idx (start); idx <= elem_idx (start + cnt - 1); idx++)
+    {
+      elem_type word = value ? b->bits[idx] : ~b->bits[idx];
+      if ((word & range_mask (idx, start, cnt)) != 0)
+        return true;
+    }
   return false;
 }
 
@@ -291,20 +421,92 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   Runs of bits are measured an element at a time, and elements
+   without any bit set to VALUE are skipped using the summary, so
+   that the time taken is proportional to the number of elements
+   looked at rather than to the number of bits. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  const elem_type *skip = value ? b->empty : b->full;
+  size_t run = 0;               /* Bits set to VALUE in a row before I. */
+  size_t i = start;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt > b->bit_cnt || start > b->bit_cnt - cnt)
+    return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+
+  while (i < b->bit_cnt)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t idx = elem_idx (i);
+      size_t ofs = i % ELEM_BITS;
+      size_t avail;
+      elem_type word, other;
+
+      if (ofs == 0)
+        {
+          /* Skip whole elements with no bit set to VALUE, and
+             ELEM_BITS of them at a time where the summary says
+             so. */
+          if (idx % ELEM_BITS == 0 && skip[elem_idx (idx)] == (elem_type) -1)
+            {
+              run = 0;
+              i += ELEM_BITS * ELEM_BITS;
+              continue;
+            }
+          if (skip[elem_idx (idx)] & bit_mask (idx))
+            {
+              run = 0;
+              i += ELEM_BITS;
+              continue;
+            }
+        }
+
+      /* The bits of this element from I on, 1 if set to VALUE. */
+      word = (value ? b->bits[idx] : ~b->bits[idx]) >> ofs;
+      avail = ELEM_BITS - ofs;
+      if (avail > b->bit_cnt - i)
+        avail = b->bit_cnt - i;
+      word &= low_mask (avail);
+
+      if (run == 0)
+        {
+          /* Move up to the next bit set to VALUE. */
+          size_t m;
+          if (word == 0)
+            {
+              i += avail;
+              continue;
+            }
+          m = lowest_bit (word);
+          i += m;
+          word >>= m;
+          avail -= m;
+        }
+
+      /* Extend the run by the bits set to VALUE from I on. */
+      other = ~word & low_mask (avail);
+      if (other == 0)
+        {
+          run += avail;
+          i += avail;
+        }
+      else
+        {
+          size_t n = lowest_bit (other);
+          if (run + n >= cnt)
+            return i - run;
+          run = 0;
+          i += n + 1;
+          continue;
+        }
+      if (run >= cnt)
+        return i - run;
     }
   return BITMAP_ERROR;
 }
@@ -344,8 +546,11 @@ bitmap_read (struct bitmap *b, struct file *file)
   if (b->bit_cnt > 0) 
     {
       off_t size = byte_cnt (b->bit_cnt);
+      size_t idx;
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      for (idx = 0; idx < elem_cnt (b->bit_cnt); idx++)
+        summary_update (b, idx);
     }
   return success;
 }
@@ -358,6 +563,29 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B holding the CNT bits starting at START to
+   FILE, at the same position as bitmap_write() would, leaving the
+   rest of FILE alone.  The part is rounded out to whole elements.
+   Returns true if successful, false otherwise. */
+bool
+bitmap_write_partial (const struct bitmap *b, struct file *file,
+                      size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t ofs, size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+  if (cnt == 0)
+    return true;
+
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  ofs = first * sizeof (elem_type);
+  size = (last - first + 1) * sizeof (elem_type);
+  return file_write_at (file, b->bits + first, size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
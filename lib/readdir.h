@@ -0,0 +1,20 @@
+#ifndef __LIB_READDIR_H
+#define __LIB_READDIR_H
+
+#include <stdbool.h>
+
+/* Maximum characters in a filename written by readdir(). */
+#define READDIR_MAX_LEN 14
+
+/* A directory entry written by readdir_batch(), which returns the
+   number of entries written, 0 at the end of the directory, or -1 if
+   the file is not an open directory or the kernel is out of memory.
+   The kernel writes these records as they are laid out here. */
+struct readdir_record
+  {
+    unsigned inumber;                   /* Inode number. */
+    bool is_dir;                        /* Is it a directory? */
+    char name[READDIR_MAX_LEN + 1];     /* Null terminated file name. */
+  };
+
+#endif /* lib/readdir.h */
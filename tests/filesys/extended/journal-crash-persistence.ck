@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+
+my ($a) = random_bytes (3000);
+my ($b) = random_bytes (3000);
+my (%fs) = ("a" => [$a], "d" => {"b" => [$b]});
+
+# "t" may have been there, empty, when the machine was killed.
+my (%actual) = read_tar ("tests/filesys/extended/journal-crash.tar");
+$fs{"t"} = [""] if exists $actual{"t"};
+
+check_archive (\%fs);
+pass;
@@ -0,0 +1,49 @@
+/* Makes a file and a directory durable with sync(), and then
+   creates and removes another file over and over, until the
+   machine is killed.  Whichever metadata updates are in progress
+   or uncommitted at the crash, the file system must come back
+   consistent, with the durable files intact. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 3000
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+static void
+write_file (const char *file_name, const char *buf)
+{
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+void
+test_main (void)
+{
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  write_file ("a", buf_a);
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+  write_file ("d/b", buf_b);
+  msg ("sync");
+  sync ();
+
+  msg ("create and remove \"t\" until killed");
+  for (;;)
+    {
+      if (!create ("t", 0))
+        fail ("create \"t\"");
+      if (!remove ("t"))
+        fail ("remove \"t\"");
+    }
+}
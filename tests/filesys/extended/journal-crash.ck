@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+# The run never ends by itself: it is killed once it times out,
+# which is the crash the file system has to survive.
+our ($test);
+my (@output) = read_text_file ("$test.output");
+
+fail "Run produced no output at all\n" if @output == 0;
+check_for_panic ("run", @output);
+check_for_keyword ("run", "FAIL", @output);
+check_for_triple_fault ("run", @output);
+fail "Run didn't get past sync()\n"
+  unless grep ($_ eq '(journal-crash) create and remove "t" until killed',
+	       @output);
+fail "Run ended before it was killed\n"
+  unless grep (/^TIMEOUT/, @output);
+pass;
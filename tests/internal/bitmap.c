@@ -0,0 +1,240 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Checks the element-at-a-time scanning and counting in bitmap.c
+   against straightforward bit-at-a-time versions, on bitmaps of
+   random contents changed by runs and by single bits, and then
+   measures how fast both of them find runs of free bits at 50%, 90%,
+   and 99% occupancy, with the used bits scattered at random or
+   clustered, as an allocator leaves them.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "threads/test.h"
+#include "devices/timer.h"
+
+/* Maximum number of bits in a bitmap that we will test. */
+#define MAX_BITS 300
+
+/* Number of bits in the bitmaps of the benchmark. */
+#define BENCH_BITS 16384
+
+/* Each measurement runs for at least this many timer ticks. */
+#define BENCH_TICKS 20
+
+static struct bitmap *random_bitmap (size_t bit_cnt, unsigned percent,
+                                     size_t max_run);
+static size_t reference_scan (const struct bitmap *, size_t start,
+                              size_t cnt, bool value);
+static size_t reference_count (const struct bitmap *, size_t start,
+                               size_t cnt, bool value);
+static void flip_random_bits (struct bitmap *);
+static void verify (const struct bitmap *);
+static void benchmark (unsigned percent, size_t max_run, size_t cnt);
+
+/* Test the bitmap implementation. */
+void
+test (void)
+{
+  static const unsigned percents[] = {0, 10, 50, 90, 99, 100};
+  static const size_t cnts[] = {1, 8, 64};
+  size_t bit_cnt, i, j;
+
+  /* Compare against the reference on bitmaps of every size up
+     to MAX_BITS, at various occupancies, before and after
+     flipping random ranges. */
+  for (bit_cnt = 0; bit_cnt <= MAX_BITS; bit_cnt++)
+    for (i = 0; i < sizeof percents / sizeof *percents; i++)
+      {
+        struct bitmap *b = random_bitmap (bit_cnt, percents[i],
+                                          bit_cnt % 2 ? 1 : 40);
+        verify (b);
+        if (bit_cnt > 0)
+          {
+            size_t start = random_ulong () % bit_cnt;
+            size_t cnt = random_ulong () % (bit_cnt - start + 1);
+            flip_random_bits (b);
+            verify (b);
+            bitmap_set_multiple (b, start, cnt, random_ulong () % 2);
+            flip_random_bits (b);
+            verify (b);
+            bitmap_flip (b, random_ulong () % bit_cnt);
+            flip_random_bits (b);
+            verify (b);
+          }
+        bitmap_destroy (b);
+      }
+  printf ("bitmap: scan and count agree with the reference\n");
+
+  for (i = 2; i < sizeof percents / sizeof *percents - 1; i++)
+    for (j = 0; j < sizeof cnts / sizeof *cnts; j++)
+      {
+        benchmark (percents[i], 1, cnts[j]);
+        benchmark (percents[i], 256, cnts[j]);
+      }
+}
+
+/* Returns a new bitmap of BIT_CNT bits, about PERCENT percent of
+   which are set to true, in runs of 1 to MAX_RUN bits set to the
+   same value. */
+static struct bitmap *
+random_bitmap (size_t bit_cnt, unsigned percent, size_t max_run)
+{
+  struct bitmap *b = bitmap_create (bit_cnt);
+  size_t i = 0;
+
+  ASSERT (b != NULL);
+  while (i < bit_cnt)
+    {
+      size_t run = random_ulong () % max_run + 1;
+      if (run > bit_cnt - i)
+        run = bit_cnt - i;
+      bitmap_set_multiple (b, i, run, random_ulong () % 100 < percent);
+      i += run;
+    }
+  return b;
+}
+
+/* Changes a few random bits of B one at a time, with bitmap_mark(),
+   bitmap_reset(), and bitmap_flip(), as palloc and swap do.  At
+   times, all of the bits of an element are set to the same value
+   this way, so that the element becomes all ones or all zeros. */
+static void
+flip_random_bits (struct bitmap *b)
+{
+  size_t size = bitmap_size (b);
+  size_t idx, start, cnt;
+  bool value;
+  int i;
+
+  if (size == 0)
+    return;
+  for (i = 0; i < 8; i++)
+    {
+      idx = random_ulong () % size;
+      switch (random_ulong () % 3)
+        {
+        case 0:
+          bitmap_mark (b, idx);
+          break;
+        case 1:
+          bitmap_reset (b, idx);
+          break;
+        default:
+          bitmap_flip (b, idx);
+          break;
+        }
+    }
+
+  /* Set a short run to the same value, bit by bit. */
+  start = random_ulong () % size;
+  cnt = random_ulong () % 40 + 1;
+  value = random_ulong () % 2;
+  for (idx = start; idx < size && idx < start + cnt; idx++)
+    if (value)
+      bitmap_mark (b, idx);
+    else
+      bitmap_reset (b, idx);
+}
+
+/* Finds the first group of CNT bits set to VALUE at or after
+   START in B, one bit at a time, as bitmap_scan() once did. */
+static size_t
+reference_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t size = bitmap_size (b);
+  size_t i, j;
+
+  if (cnt > size)
+    return BITMAP_ERROR;
+  for (i = start; i + cnt <= size; i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j) != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Counts the bits set to VALUE among CNT bits starting at START
+   in B, one bit at a time. */
+static size_t
+reference_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      value_cnt++;
+  return value_cnt;
+}
+
+/* Verifies bitmap_scan(), bitmap_count(), and bitmap_contains()
+   on B against the reference versions, at random positions. */
+static void
+verify (const struct bitmap *b)
+{
+  size_t size = bitmap_size (b);
+  int i;
+
+  for (i = 0; i < 16; i++)
+    {
+      size_t start = random_ulong () % (size + 1);
+      size_t cnt = random_ulong () % (size - start + 1);
+      bool value = random_ulong () % 2;
+
+      ASSERT (bitmap_count (b, start, cnt, value)
+              == reference_count (b, start, cnt, value));
+      ASSERT (bitmap_contains (b, start, cnt, value)
+              == (reference_count (b, start, cnt, value) > 0));
+      if (cnt > 0 && i % 2)
+        cnt = cnt % 8 + 1;
+      ASSERT (bitmap_scan (b, start, cnt, value)
+              == reference_scan (b, start, cnt, value));
+    }
+}
+
+/* Prints how many times per second the first run of CNT false
+   bits is found, on a bitmap of BENCH_BITS bits of which PERCENT
+   percent are true, in runs of up to MAX_RUN bits, by
+   bitmap_scan() and by the reference. */
+static void
+benchmark (unsigned percent, size_t max_run, size_t cnt)
+{
+  struct bitmap *b = random_bitmap (BENCH_BITS, percent, max_run);
+  size_t expected = reference_scan (b, 0, cnt, false);
+  unsigned long rates[2];
+  int impl;
+
+  for (impl = 0; impl < 2; impl++)
+    {
+      unsigned long scans = 0;
+      int64_t start = timer_ticks ();
+      int64_t elapsed;
+      do
+        {
+          size_t idx = (impl == 0
+                        ? bitmap_scan (b, 0, cnt, false)
+                        : reference_scan (b, 0, cnt, false));
+          ASSERT (idx == expected);
+          scans++;
+          elapsed = timer_elapsed (start);
+        }
+      while (elapsed < BENCH_TICKS);
+      rates[impl] = scans * TIMER_FREQ / elapsed;
+    }
+  printf ("bitmap: %u%% used %s, run of %zu: %lu scans/s "
+          "(bit at a time: %lu scans/s)\n",
+          percent, max_run > 1 ? "clustered" : "scattered", cnt,
+          rates[0], rates[1]);
+  bitmap_destroy (b);
+}
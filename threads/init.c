@@ -38,6 +38,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -259,6 +260,17 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        buffer_cache_configure (atoi (value));
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value == NULL || !buffer_cache_configure_policy (value))
+            PANIC ("unknown buffer cache policy `%s'", value);
+        }
+      else if (!strcmp (name, "-wb-interval"))
+        buffer_cache_configure_write_behind (atoi (value), 0);
+      else if (!strcmp (name, "-wb-ratio"))
+        buffer_cache_configure_write_behind (0, atoi (value));
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -385,6 +397,10 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Set buffer cache size (default: RAM/16).\n"
+          "  -cache-policy=NAME Use NAME (2q or clock) for cache replacement.\n"
+          "  -wb-interval=MS    Write dirty cache blocks back every MS ms.\n"
+          "  -wb-ratio=PERCENT  Write back early when PERCENT of cache is dirty.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
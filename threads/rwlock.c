@@ -0,0 +1,121 @@
+#include <debug.h>
+
+#include "threads/rwlock.h"
+#include "threads/interrupt.h"
+#include "threads/thread.h"
+
+/* 
+ * Initializes RWLOCK.  A readers-writer lock can be held either by
+ * any number of readers at once, or by a single writer.
+ *
+ * Writers are preferred: once a writer is waiting, new readers
+ * wait as well, so that a steady stream of readers can't starve
+ * the writers.  Like locks, readers-writer locks are not
+ * recursive.
+ */
+void
+rwlock_init(struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+
+    lock_init(&rw->lock);
+    condvar_init(&rw->readers_ok);
+    condvar_init(&rw->writers_ok);
+    rw->readers = 0;
+    rw->waiting_writers = 0;
+    rw->writer = NULL;
+}
+
+/* 
+ * Acquires RW for reading, sleeping while it is held, or waited
+ * for, by a writer.
+ *
+ * This function may sleep, so it must not be called within an
+ * interrupt handler.
+ */
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+    ASSERT(!intr_context());
+
+    lock_acquire(&rw->lock);
+    while (rw->writer != NULL || rw->waiting_writers > 0) {
+        condvar_wait(&rw->readers_ok, &rw->lock);
+    }
+    rw->readers++;
+    lock_release(&rw->lock);
+}
+
+/* 
+ * Releases RW, which must be held for reading by the current
+ * thread.
+ */
+void
+rwlock_release_read(struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+
+    lock_acquire(&rw->lock);
+    ASSERT(rw->readers > 0);
+    if (--rw->readers == 0) {
+        condvar_signal(&rw->writers_ok, &rw->lock);
+    }
+    lock_release(&rw->lock);
+}
+
+/* 
+ * Acquires RW for writing, sleeping until no other thread holds
+ * it.  RW must not already be held by the current thread.
+ *
+ * This function may sleep, so it must not be called within an
+ * interrupt handler.
+ */
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+    ASSERT(!intr_context());
+    ASSERT(!rwlock_held_for_write(rw));
+
+    lock_acquire(&rw->lock);
+    rw->waiting_writers++;
+    while (rw->writer != NULL || rw->readers > 0) {
+        condvar_wait(&rw->writers_ok, &rw->lock);
+    }
+    rw->waiting_writers--;
+    rw->writer = thread_current();
+    lock_release(&rw->lock);
+}
+
+/* 
+ * Releases RW, which must be held for writing by the current
+ * thread.  A waiting writer goes first; otherwise all of the
+ * waiting readers are woken up.
+ */
+void
+rwlock_release_write(struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+    ASSERT(rwlock_held_for_write(rw));
+
+    lock_acquire(&rw->lock);
+    rw->writer = NULL;
+    if (rw->waiting_writers > 0) {
+        condvar_signal(&rw->writers_ok, &rw->lock);
+    } else {
+        condvar_broadcast(&rw->readers_ok, &rw->lock);
+    }
+    lock_release(&rw->lock);
+}
+
+/* 
+ * Returns true if the current thread holds RW for writing, false
+ * otherwise.
+ */
+bool
+rwlock_held_for_write(const struct rwlock *rw)
+{
+    ASSERT(rw != NULL);
+    return rw->writer == thread_current();
+}
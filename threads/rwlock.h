@@ -0,0 +1,25 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdbool.h>
+#include "threads/condvar.h"
+#include "threads/lock.h"
+
+/* Readers-writer lock */
+struct rwlock {
+    struct lock lock; /* Protects the members below */
+    struct condvar readers_ok; /* Signaled when readers may proceed */
+    struct condvar writers_ok; /* Signaled when a writer may proceed */
+    unsigned readers; /* Number of readers holding the lock */
+    unsigned waiting_writers; /* Number of writers waiting for the lock */
+    struct thread *writer; /* Writer holding the lock, or NULL */
+};
+
+void rwlock_init(struct rwlock *);
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_held_for_write(const struct rwlock *);
+
+#endif /* UCSC CMPS111 */
@@ -140,6 +140,9 @@ struct thread
                            // i.e the current value of the user program’s stack pointer
     struct dir *cwd;	   // Current Working Directory, if any
 
+    // Owned by filesys/journal.c.
+    int journal_depth;     // Nesting depth of journal_begin() calls
+
     // Owned by thread.c. 
     unsigned magic;        // Detects stack overflow. 
 
@@ -12,6 +12,7 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "vm/frame.h"
 #include "vm/page.h"
 #include "threads/flags.h"
@@ -30,6 +31,9 @@
 
 static thread_func start_process NO_RETURN;
 
+/* Maximum number of entries read by a single readdir_batch() call. */
+#define READDIR_BATCH_MAX 64
+
 // *****************************************************************
 // CMPS111 Lab 3 : Remove the comment on this literal when you are 
 // ready to start testing command line arguments
@@ -263,26 +267,18 @@ process_exit(void)
 *   Returns the file_info for the file with the file id that equals file_number
 *   Returns NULL if the file is not found or if the current thread's list of open files
 *   is empty
+*   The list belongs to the current thread only, so no lock is needed
 */
 static struct file_info* find_file_by_id(int file_number){
     struct file_info *fi = NULL;
-    if(!list_empty(&thread_current()->file_list)){
-        for(struct list_elem *curr = list_front(&thread_current()->file_list); curr != list_end(&thread_current()->file_list);
-          curr = list_next(curr)){
-              struct file_info *curr_info = list_entry(curr, struct file_info, elem);
-              if(curr_info->id == file_number){
-                  fi = curr_info;
-                  break;
-              }
-          }
-          if(fi == NULL){
-              lock_release(&sys_lock);
-              return NULL;
+    for(struct list_elem *curr = list_begin(&thread_current()->file_list); curr != list_end(&thread_current()->file_list);
+      curr = list_next(curr)){
+          struct file_info *curr_info = list_entry(curr, struct file_info, elem);
+          if(curr_info->id == file_number){
+              fi = curr_info;
+              break;
           }
-    }else{
-      lock_release(&sys_lock);
-      return NULL;
-    }
+      }
 
     return fi;
 }
@@ -311,28 +307,38 @@ void exit_handler(struct intr_frame *f)
 
 /*
  * BUFFER+0 and BUFFER+size should be valid user adresses
+ * File I/O needs no global lock: the inode locks the range written
+ * The user buffer is copied a page at a time into a kernel page, and
+ * written from there: it may page fault, which it must not do while
+ * the inode's locks are held
  */
 static uint32_t sys_write(int fd, const void *buffer, unsigned size)
 {
   umem_check((const uint8_t*) buffer);
   umem_check((const uint8_t*) buffer + size - 1);
 
-  int ret = -1;
-
-  lock_acquire(&sys_lock);
   if (fd == 1) { // write to stdout
     putbuf(buffer, size);
-    ret = size;
+    return size;
   }
 
   struct file_info *fi = NULL;
   fi = find_file_by_id(fd);
   if(fi == NULL) return -1;
 
-  ret = file_write(fi->filename, buffer, size);
-  lock_release(&sys_lock);
+  void *page = palloc_get_page(0);
+  if(page == NULL) return -1;
+  unsigned written = 0;
+  while(written < size){
+    unsigned chunk = size - written < PGSIZE ? size - written : PGSIZE;
+    umem_read((uint8_t *) buffer + written, page, chunk);
+    int ret = file_write(fi->filename, page, chunk);
+    if(ret > 0) written += ret;
+    if(ret < (int) chunk) break;
+  }
+  palloc_free_page(page);
 
-  return (uint32_t) ret;
+  return written;
 } 
 
 /*
@@ -416,13 +422,25 @@ void open_handler(struct intr_frame *f)
 *   Reads only a certain size of the file and returns the number of bytes read
 */
 static int sys_read(int file_num, void* buffer, int size){
-    lock_acquire(&sys_lock);
     struct file_info *fi = NULL;
     fi= find_file_by_id(file_num);
     if(fi == NULL) return -1;
 
-    int status = file_read(fi->filename, buffer, size);
-    lock_release(&sys_lock);
+    // read into a kernel page, and copied out once the inode's locks
+    // are released: the user buffer may page fault
+    void *page = palloc_get_page(0);
+    if(page == NULL) return -1;
+    int status = 0;
+    while(status < size){
+        int chunk = size - status < PGSIZE ? size - status : PGSIZE;
+        int ret = file_read(fi->filename, page, chunk);
+        if(ret > 0){
+            umem_write((uint8_t *) buffer + status, page, ret);
+            status += ret;
+        }
+        if(ret < chunk) break;
+    }
+    palloc_free_page(page);
     return status;
 }
 
@@ -447,13 +465,11 @@ void read_handler(struct intr_frame *f)
 *   Returns the size of a file specified by file_number
 */
 static int sys_filesize(int file_number){
-    lock_acquire(&sys_lock);
     struct file_info *fi = NULL;
     fi = find_file_by_id(file_number);
     if(fi == NULL) return -1;
 
     int status = file_length(fi->filename);
-    lock_release(&sys_lock);
     return status;
 }
 
@@ -479,7 +495,10 @@ static int sys_close(int file_number){
 
     struct file_info *fi = NULL;
     fi = find_file_by_id(file_number);
-    if(fi == NULL) return -1;
+    if(fi == NULL){
+        lock_release(&sys_lock);
+        return -1;
+    }
 
     thread_current()->open_file_count --;
     file_close(fi->filename);
@@ -544,3 +563,178 @@ void exec_handler(struct intr_frame *f)
     int status = sys_exec(command_line);
     f->eax = status;
 }
+
+/*
+*   Reads up to cnt entries of the directory with file descriptor file_number
+*   into records, a kernel buffer, from the position of the file, and advances it
+*   Returns the number of entries read, 0 at the end of the directory,
+*   or -1 if file_number is not a directory
+*/
+static int read_directory(int file_number, struct readdir_record *records, unsigned cnt){
+    struct file_info *fi = NULL;
+    fi = find_file_by_id(file_number);
+    if(fi == NULL) return -1;
+
+    struct inode *inode = file_get_inode(fi->filename);
+    if(!inode_is_directory(inode)) return -1;
+
+    lock_acquire(&sys_lock);
+    struct dir *dir = dir_open(inode_reopen(inode));
+    if(dir == NULL){
+        lock_release(&sys_lock);
+        return -1;
+    }
+    dir_seek(dir, file_tell(fi->filename));
+    int status = dir_readdir_batch(dir, records, cnt);
+    file_seek(fi->filename, dir_tell(dir));
+    dir_close(dir);
+    lock_release(&sys_lock);
+    return status;
+}
+
+/*
+*   Implementation of readdir_handler()
+*   Reads the name of the next entry of the directory file_number into name
+*   and returns if there was one
+*/
+static bool sys_readdir(int file_number, char *name){
+    struct readdir_record record;
+    if(read_directory(file_number, &record, 1) != 1) return false;
+
+    umem_write(name, record.name, strlen(record.name) + 1);
+    return true;
+}
+
+/*
+*   Reads the name of the next entry of the directory file_number into name
+*   and returns if there was one
+*/
+void readdir_handler(struct intr_frame *f)
+{
+    int file_number;
+    char *name;
+
+    umem_read(f->esp + 4, &file_number, sizeof(file_number));
+    umem_read(f->esp + 8, &name, sizeof(name));
+
+    f->eax = sys_readdir(file_number, name);
+}
+
+/*
+*   Implementation of readdir_batch_handler()
+*   Reads as many entries of the directory file_number as fit in records,
+*   up to cnt (and READDIR_BATCH_MAX), and returns their number
+*   (0 at the end of the directory), or -1 if file_number is not a directory
+*   or the kernel is out of memory
+*/
+static int sys_readdir_batch(int file_number, struct readdir_record *records, unsigned cnt){
+    if(cnt == 0) return 0;
+    if(cnt > READDIR_BATCH_MAX) cnt = READDIR_BATCH_MAX;
+
+    // read into a kernel buffer, and copied out once sys_lock is released
+    struct readdir_record *buffer = malloc(cnt * sizeof *buffer);
+    if(buffer == NULL) return -1;
+    int status = read_directory(file_number, buffer, cnt);
+    if(status > 0)
+        umem_write(records, buffer, status * sizeof *buffer);
+    free(buffer);
+    return status;
+}
+
+/*
+*   Reads as many entries of the directory file_number as fit in records,
+*   up to cnt, and returns their number (0 at the end of the directory)
+*/
+void readdir_batch_handler(struct intr_frame *f)
+{
+    int file_number;
+    struct readdir_record *records;
+    unsigned cnt;
+
+    umem_read(f->esp + 4, &file_number, sizeof(file_number));
+    umem_read(f->esp + 8, &records, sizeof(records));
+    umem_read(f->esp + 12, &cnt, sizeof(cnt));
+
+    f->eax = sys_readdir_batch(file_number, records, cnt);
+}
+
+/*
+*   Implementation of isdir_handler()
+*   Returns if the file file_number is a directory
+*/
+static bool sys_isdir(int file_number){
+    struct file_info *fi = NULL;
+    fi = find_file_by_id(file_number);
+    if(fi == NULL) return false;
+
+    return inode_is_directory(file_get_inode(fi->filename));
+}
+
+/*
+*   Returns if the file file_number is a directory
+*/
+void isdir_handler(struct intr_frame *f)
+{
+    int file_number;
+
+    umem_read(f->esp + 4, &file_number, sizeof(file_number));
+
+    f->eax = sys_isdir(file_number);
+}
+
+/*
+*   Implementation of inumber_handler()
+*   Returns the inode number of the file file_number
+*/
+static int sys_inumber(int file_number){
+    struct file_info *fi = NULL;
+    fi = find_file_by_id(file_number);
+    if(fi == NULL) return -1;
+
+    return inode_get_inumber(file_get_inode(fi->filename));
+}
+
+/*
+*   Returns the inode number of the file file_number
+*/
+void inumber_handler(struct intr_frame *f)
+{
+    int file_number;
+
+    umem_read(f->esp + 4, &file_number, sizeof(file_number));
+
+    f->eax = sys_inumber(file_number);
+}
+
+/*
+*   Implementation of fsync_handler()
+*   Writes the data of the file file_number to disk, and returns if it was successful
+*   No global lock: concurrent callers share their disk writes (see inode_sync())
+*/
+static bool sys_fsync(int file_number){
+    struct file_info *fi = NULL;
+    fi = find_file_by_id(file_number);
+    if(fi == NULL) return false;
+
+    return file_sync(fi->filename);
+}
+
+/*
+*   Writes the data of the file file_number to disk, and returns if it was successful
+*/
+void fsync_handler(struct intr_frame *f)
+{
+    int file_number;
+
+    umem_read(f->esp + 4, &file_number, sizeof(file_number));
+
+    f->eax = sys_fsync(file_number);
+}
+
+/*
+*   Writes all of the data of the file system to disk
+*/
+void sync_handler(struct intr_frame *f UNUSED)
+{
+    filesys_sync();
+}
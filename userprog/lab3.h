@@ -38,5 +38,11 @@ void filesize_handler(struct intr_frame *);
 void close_handler(struct intr_frame *);
 void wait_handler(struct intr_frame *);
 void exec_handler(struct intr_frame *);
+void readdir_handler(struct intr_frame *);
+void readdir_batch_handler(struct intr_frame *);
+void isdir_handler(struct intr_frame *);
+void inumber_handler(struct intr_frame *);
+void fsync_handler(struct intr_frame *);
+void sync_handler(struct intr_frame *);
 
 #endif
\ No newline at end of file
@@ -113,6 +113,30 @@ syscall_handler(struct intr_frame *f)
     exec_handler(f);
     break;
 
+  case SYS_READDIR:
+    readdir_handler(f);
+    break;
+
+  case SYS_READDIR_BATCH:
+    readdir_batch_handler(f);
+    break;
+
+  case SYS_ISDIR:
+    isdir_handler(f);
+    break;
+
+  case SYS_INUMBER:
+    inumber_handler(f);
+    break;
+
+  case SYS_FSYNC:
+    fsync_handler(f);
+    break;
+
+  case SYS_SYNC:
+    sync_handler(f);
+    break;
+
   default:
     printf("[ERROR] system call %d is unimplemented!\n", syscall);
     thread_exit();
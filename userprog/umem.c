@@ -80,3 +80,13 @@ int umem_read(void *src, void *dst, size_t bytes)
     }
     return (int) bytes;
 }
+
+int umem_write(void *dst, const void *src, size_t bytes)
+{
+    size_t i;
+    for (i = 0; i < bytes; i++) {
+        if (!umem_put(dst + i, *(const uint8_t*) (src + i)))
+            throw_segmantation_fault();
+    }
+    return (int) bytes;
+}
@@ -63,3 +63,12 @@ bool umem_put(uint8_t *udst, uint8_t byte);
  * fault and the system will exit.
  */
 int umem_read(void *src, void *dst, size_t bytes);
+
+/*
+ * Writes consecutive BYTES from kernel memory starting at SRC to user
+ * memory starting at DST, a byte at a time through umem_put().
+ *
+ * Returns the number of bytes written. Invalid access causes a
+ * segmentation fault and the system will exit.
+ */
+int umem_write(void *dst, const void *src, size_t bytes);